@@ -0,0 +1,269 @@
+// Microbenchmarks for the codec and the dispatcher.
+//
+// Reports ns/op, messages/sec and heap allocations per operation for
+// encode, decode and dispatch of every lease message, as JSON on stdout.
+// Messages are generated from a fixed seed so runs are comparable.
+//
+//   usage: codec_bench [iterations] [seed]
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "codec.h"
+#include "dispatcher.h"
+#include "io_buffer.h"
+#include "message_pool.h"
+#include "static_dispatcher.h"
+
+// Count every heap allocation, libprotobuf's included.
+static std::atomic<uint64_t> s_allocations(0);
+
+#if defined(__GNUC__) && __GNUC__ >= 11
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void* operator new(size_t size)
+{
+    s_allocations.fetch_add(1, std::memory_order_relaxed);
+    void* p = malloc(size ? size : 1);
+    if(! p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    free(p);
+}
+
+namespace {
+
+const int kSamples = 256;
+
+uint64_t s_sink = 0;
+bool s_first_result = true;
+
+template <typename Op>
+void Run(const std::string& name, int iterations, Op op)
+{
+    // warm up caches, pools and lazily built tables.
+    for(int i = 0; i < kSamples; i++) {
+        op(i);
+    }
+
+    const uint64_t allocations = s_allocations.load(std::memory_order_relaxed);
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for(int i = 0; i < iterations; i++) {
+        op(i % kSamples);
+    }
+    const std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    const uint64_t allocated = s_allocations.load(std::memory_order_relaxed) - allocations;
+
+    const double ns = std::chrono::duration<double, std::nano>(end - start).count();
+    const double ns_per_op = ns / iterations;
+    printf("%s\n    {\"name\": \"%s\", \"iterations\": %d, \"ns_per_op\": %.2f, "
+            "\"msgs_per_sec\": %.0f, \"allocs_per_op\": %.3f}",
+            s_first_result ? "" : ",", name.c_str(), iterations, ns_per_op,
+            ns_per_op > 0 ? 1e9 / ns_per_op : 0.0, double(allocated) / iterations);
+    s_first_result = false;
+}
+
+void RandomFill(std::mt19937* rng, paxoslease::PrepareRequest* message)
+{
+    message->set_node_id((*rng)() % 64);
+    message->set_ballot_number((*rng)());
+}
+
+void RandomFill(std::mt19937* rng, paxoslease::PrepareResponse* message)
+{
+    message->set_node_id((*rng)() % 64);
+    message->set_ballot_number((*rng)());
+    message->set_lease_empty((*rng)() & 1);
+}
+
+void RandomFill(std::mt19937* rng, paxoslease::ProposeRequest* message)
+{
+    message->set_node_id((*rng)() % 64);
+    message->set_ballot_number((*rng)());
+}
+
+void RandomFill(std::mt19937* rng, paxoslease::ProposeResponse* message)
+{
+    message->set_node_id((*rng)() % 64);
+    message->set_ballot_number((*rng)());
+}
+
+const char* FormatName(FrameFormat format)
+{
+    switch(format) {
+    case kFrameTypeName: return "type_name";
+    case kFrameTypeId:   return "type_id";
+    case kFrameFixed:    return "fixed";
+    }
+    return "unknown";
+}
+
+struct BenchHandler {
+    void OnMessage(paxoslease::PrepareRequest& m) { s_sink += m.ballot_number(); }
+    void OnMessage(paxoslease::PrepareResponse& m) { s_sink += m.ballot_number(); }
+    void OnMessage(paxoslease::ProposeRequest& m) { s_sink += m.ballot_number(); }
+    void OnMessage(paxoslease::ProposeResponse& m) { s_sink += m.ballot_number(); }
+};
+
+typedef paxoslease::StaticDispatcher<BenchHandler, paxoslease::PrepareRequest, paxoslease::PrepareResponse,
+        paxoslease::ProposeRequest, paxoslease::ProposeResponse> BenchStaticDispatcher;
+
+template <typename T>
+void BenchMessage(int iterations, std::mt19937* rng, const paxoslease::ProtobufDispatcher& dispatcher,
+        const paxoslease::ProtobufDispatcher& instrumented)
+{
+    const std::string type = T::descriptor()->name();
+
+    std::vector<T> samples(kSamples);
+    for(int i = 0; i < kSamples; i++) {
+        RandomFill(rng, &samples[i]);
+    }
+
+    const FrameFormat formats[] = { kFrameTypeName, kFrameTypeId, kFrameFixed };
+    for(size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); f++) {
+        const FrameFormat format = formats[f];
+        const std::string suffix = type + "/" + FormatName(format);
+
+        Run("encode_string/" + suffix, iterations, [&](int i) {
+            s_sink += Encode(samples[i], format).size();
+        });
+
+        paxoslease::IOBuffer out;
+        Run("encode_iobuffer/" + suffix, iterations, [&](int i) {
+            s_sink += Encode(samples[i], &out, format);
+            out.Clear();
+        });
+
+        std::vector<std::string> frames(kSamples);
+        std::vector<paxoslease::IOBuffer*> buffers(kSamples);
+        for(int i = 0; i < kSamples; i++) {
+            frames[i] = Encode(samples[i], format);
+            buffers[i] = new paxoslease::IOBuffer();
+            buffers[i]->CopyIn(frames[i].data(), frames[i].size());
+        }
+
+        Run("decode_string/" + suffix, iterations, [&](int i) {
+            google::protobuf::Message* message = Decode(frames[i]);
+            s_sink += (message != NULL);
+            delete message;
+        });
+
+        paxoslease::MessagePool pool;
+        Run("decode_string_pooled/" + suffix, iterations, [&](int i) {
+            paxoslease::MessagePtr message = Decode(frames[i], &pool);
+            s_sink += (message != NULL);
+        });
+
+        Run("decode_iobuffer_pooled/" + suffix, iterations, [&](int i) {
+            paxoslease::MessagePtr message = Decode(*buffers[i], &pool);
+            s_sink += (message != NULL);
+        });
+
+        Run("decode_dispatch_pooled/" + suffix, iterations, [&](int i) {
+            paxoslease::MessagePtr message = Decode(*buffers[i], &pool);
+            dispatcher.OnMessage(message.get());
+        });
+
+        BenchHandler handler;
+        BenchStaticDispatcher static_dispatcher(&handler);
+        Run("decode_static_dispatch/" + suffix, iterations, [&](int i) {
+            s_sink += static_dispatcher.Dispatch(frames[i]);
+        });
+
+        for(int i = 0; i < kSamples; i++) {
+            delete buffers[i];
+        }
+
+        Run("encode_iobuffer_crc32c/" + suffix, iterations, [&](int i) {
+            s_sink += Encode(samples[i], &out, format, true);
+            out.Clear();
+        });
+
+        for(int i = 0; i < kSamples; i++) {
+            frames[i] = Encode(samples[i], format, true);
+        }
+        Run("decode_string_pooled_crc32c/" + suffix, iterations, [&](int i) {
+            paxoslease::MessagePtr message = Decode(frames[i], &pool);
+            s_sink += (message != NULL);
+        });
+    }
+
+    char frame[64];
+    Run("encode_fixed_typed/" + type, iterations, [&](int i) {
+        s_sink += EncodeFixed(samples[i], frame);
+    });
+
+    std::vector<std::string> fixed_frames(kSamples);
+    for(int i = 0; i < kSamples; i++) {
+        fixed_frames[i] = Encode(samples[i], kFrameFixed);
+    }
+    T decoded;
+    Run("decode_fixed_typed/" + type, iterations, [&](int i) {
+        s_sink += DecodeFixed(fixed_frames[i].data(), fixed_frames[i].size(), &decoded);
+    });
+
+    Run("dispatch/" + type, iterations, [&](int i) {
+        dispatcher.OnMessage(&samples[i]);
+    });
+
+    Run("dispatch_stats/" + type, iterations, [&](int i) {
+        instrumented.OnMessage(&samples[i], 16);
+    });
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    const int iterations = argc > 1 ? atoi(argv[1]) : 200000;
+    const unsigned seed = argc > 2 ? strtoul(argv[2], NULL, 10) : 42;
+    if(iterations <= 0) {
+        fprintf(stderr, "usage: %s [iterations] [seed]\n", argv[0]);
+        return 1;
+    }
+
+    paxoslease::ProtobufDispatcher dispatcher, instrumented;
+    paxoslease::ProtobufDispatcher* dispatchers[] = { &dispatcher, &instrumented };
+    for(int i = 0; i < 2; i++) {
+        dispatchers[i]->RegisterMessageCallback<paxoslease::PrepareRequest>(
+                [](paxoslease::PrepareRequest* m) { s_sink += m->ballot_number(); });
+        dispatchers[i]->RegisterMessageCallback<paxoslease::PrepareResponse>(
+                [](paxoslease::PrepareResponse* m) { s_sink += m->ballot_number(); });
+        dispatchers[i]->RegisterMessageCallback<paxoslease::ProposeRequest>(
+                [](paxoslease::ProposeRequest* m) { s_sink += m->ballot_number(); });
+        dispatchers[i]->RegisterMessageCallback<paxoslease::ProposeResponse>(
+                [](paxoslease::ProposeResponse* m) { s_sink += m->ballot_number(); });
+    }
+    paxoslease::DispatchStats stats;
+    instrumented.SetStats(&stats);
+
+    std::mt19937 rng(seed);
+
+    printf("{\n  \"benchmark\": \"codec\",\n  \"seed\": %u,\n  \"crc32c_accelerated\": %s,\n  \"results\": [",
+            seed, paxoslease::Crc32cIsAccelerated() ? "true" : "false");
+    BenchMessage<paxoslease::PrepareRequest>(iterations, &rng, dispatcher, instrumented);
+    BenchMessage<paxoslease::PrepareResponse>(iterations, &rng, dispatcher, instrumented);
+    BenchMessage<paxoslease::ProposeRequest>(iterations, &rng, dispatcher, instrumented);
+    BenchMessage<paxoslease::ProposeResponse>(iterations, &rng, dispatcher, instrumented);
+    printf("\n  ],\n  \"sink\": %llu\n}\n", (unsigned long long)s_sink);
+
+    return 0;
+}
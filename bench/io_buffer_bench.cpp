@@ -0,0 +1,853 @@
+// Throughput benchmarks and a differential stress test for IOBuffer.
+//
+// The benchmarks report ns/op, MB/sec and heap allocations per operation
+// for CopyIn, Copy, Move, Consume, Trim and Coalesce, and for Write/Read
+// through a pipe and a socketpair, across block sizes and fragment sizes,
+// as JSON on stdout.
+//
+// The stress test applies random operations to IOBuffers and checks each
+// result against a flat std::string model; it exits 1 on the first
+// mismatch and prints the op and seed to reproduce it. It also keeps both
+// the watermarks of one buffer and the process-wide ones, whose callback
+// frees IOBuffers, in step with the models, round trips data through an
+// IOBufferSplicer, and encodes frames into a buffer with watermarks. A short stress run follows the benchmarks.
+//
+// stress-hugepage runs it with every block from a HugePageIOBufferAllocator.
+//
+//   usage: io_buffer_bench [iterations] [seed]
+//          io_buffer_bench stress [ops] [seed]
+//          io_buffer_bench stress-hugepage [ops] [seed]
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "codec.h"
+#include "hugepage_io_buffer_allocator.h"
+#include "io_buffer.h"
+#include "io_buffer_splice.h"
+#include "uring_io_buffer_reader.h"
+
+// Count every heap allocation, IOBufferData blocks included.
+static std::atomic<uint64_t> s_allocations(0);
+
+#if defined(__GNUC__) && __GNUC__ >= 11
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void* operator new(size_t size)
+{
+    s_allocations.fetch_add(1, std::memory_order_relaxed);
+    void* p = malloc(size ? size : 1);
+    if(! p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    free(p);
+}
+
+namespace {
+
+using paxoslease::IOBuffer;
+using paxoslease::IOBufferData;
+using paxoslease::IOBufferSplicer;
+using paxoslease::HugePageIOBufferAllocator;
+using paxoslease::IOBufferMemoryCallback;
+using paxoslease::IOBufferMemoryAboveHigh;
+using paxoslease::IOBufferMemoryUsage;
+using paxoslease::SetIOBufferMemoryWatermarks;
+
+const int kPayloadSize = 64 << 10;
+const int kBlockSizes[] = { 512, 4 << 10, 16 << 10 };
+const int kFragmentSizes[] = { 40, 512, 4 << 10 };
+
+uint64_t s_sink = 0;
+bool s_first_result = true;
+
+template <typename Op>
+void Run(const std::string& name, int iterations, int bytes_per_op, Op op)
+{
+    // warm up caches and the allocator.
+    for(int i = 0; i < 16; i++) {
+        op();
+    }
+
+    const uint64_t allocations = s_allocations.load(std::memory_order_relaxed);
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for(int i = 0; i < iterations; i++) {
+        op();
+    }
+    const std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    const uint64_t allocated = s_allocations.load(std::memory_order_relaxed) - allocations;
+
+    const double ns = std::chrono::duration<double, std::nano>(end - start).count();
+    const double ns_per_op = ns / iterations;
+    printf("%s\n    {\"name\": \"%s\", \"iterations\": %d, \"ns_per_op\": %.2f, "
+            "\"mb_per_sec\": %.1f, \"allocs_per_op\": %.3f}",
+            s_first_result ? "" : ",", name.c_str(), iterations, ns_per_op,
+            ns_per_op > 0 ? bytes_per_op * 1e3 / ns_per_op : 0.0, double(allocated) / iterations);
+    s_first_result = false;
+}
+
+std::string Suffix(int block_size, int fragment_size)
+{
+    return "/block_" + std::to_string(block_size) + "/fragment_" + std::to_string(fragment_size);
+}
+
+// Append the payload to buf in fragments of fragment_size, each in a block
+// of its own with room for block_size, as a buffer assembled by Move() from
+// received or encoded messages is.
+void Build(IOBuffer* buf, const std::string& payload, int block_size, int fragment_size)
+{
+    const int size = payload.size();
+    for(int offset = 0; offset < size; ) {
+        IOBufferData data(block_size);
+        const int nb = data.CopyIn(payload.data() + offset, std::min(fragment_size, size - offset));
+        buf->Append(data);
+        offset += nb;
+    }
+}
+
+// CopyIn() a payload in fragment_size pieces into default blocks.
+void BenchCopyIn(int iterations, const std::string& payload, int fragment_size)
+{
+    const int size = payload.size();
+    Run("copy_in/fragment_" + std::to_string(fragment_size), iterations, size, [&]() {
+        IOBuffer buf;
+        for(int offset = 0; offset < size; offset += fragment_size) {
+            buf.CopyIn(payload.data() + offset, std::min(fragment_size, size - offset));
+        }
+        s_sink += buf.BytesConsumable();
+    });
+}
+
+void BenchBuffer(int iterations, const std::string& payload, int block_size, int fragment_size)
+{
+    const std::string suffix = Suffix(block_size, fragment_size);
+    const int size = payload.size();
+    const int n = iterations;
+
+    IOBuffer source;
+    Build(&source, payload, block_size, fragment_size);
+
+    Run("copy" + suffix, n, size, [&]() {
+        IOBuffer buf;
+        s_sink += buf.Copy(&source, size);
+    });
+
+    IOBuffer a, b;
+    a.Copy(&source, size);
+    Run("move_partial" + suffix, n, size, [&]() {
+        // 1000 bytes at a time, splitting blocks at odd offsets.
+        while(! a.IsEmpty()) {
+            s_sink += b.Move(&a, 1000);
+        }
+        a.Move(&b);
+    });
+
+    Run("clone_trim_consume" + suffix, n, size, [&]() {
+        IOBuffer* clone = a.Clone();
+        s_sink += clone->Trim(size - size / 3);
+        s_sink += clone->Consume(size / 3);
+        delete clone;
+    });
+
+    Run("coalesce" + suffix, n, size, [&]() {
+        IOBuffer buf;
+        buf.Copy(&source, size);
+        s_sink += buf.Coalesce();
+    });
+}
+
+bool MakeNonBlocking(int fd)
+{
+    const int flags = fcntl(fd, F_GETFL);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+// Write a payload-sized buffer to fds[1] and read it back from fds[0],
+// both non-blocking, a chunk at a time as a network loop would.
+void BenchFd(int iterations, const std::string& kind, int fds[2], const std::string& payload,
+        int block_size, int fragment_size, bool coalesce, paxoslease::UringIOBufferReader* reader)
+{
+    const int size = payload.size();
+    const int n = std::max(1, iterations / 16);
+    IOBuffer source;
+    Build(&source, payload, block_size, fragment_size);
+
+    std::string name = "write_read_" + kind + Suffix(block_size, fragment_size);
+    name += coalesce ? "/coalesce" : "/no_coalesce";
+    name += reader ? "/uring" : "/readv";
+
+    Run(name, n, size, [&]() {
+        IOBuffer out, in;
+        if(! coalesce) {
+            out.SetCoalescePolicy(IOBuffer::CoalescePolicy(0, 0, 0));
+        }
+        out.Copy(&source, size);
+        int nread = 0;
+        while(nread < size) {
+            if(! out.IsEmpty()) {
+                out.Write(fds[1]);
+            }
+            const int nr = reader ? reader->Read(fds[0], &in) : in.Read(fds[0]);
+            if(nr > 0) {
+                nread += nr;
+            } else if(nr != -EAGAIN) {
+                fprintf(stderr, "%s: read failed: %d\n", name.c_str(), nr);
+                exit(1);
+            }
+        }
+        s_sink += in.BytesConsumable();
+    });
+}
+
+void BenchFds(int iterations, const std::string& payload)
+{
+    paxoslease::UringIOBufferReader reader;
+    for(int kind = 0; kind < 2; kind++) {
+        int fds[2];
+        const bool ok = kind == 0 ? pipe(fds) == 0 : socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0;
+        if(! ok || ! MakeNonBlocking(fds[0]) || ! MakeNonBlocking(fds[1])) {
+            fprintf(stderr, "can not create %s\n", kind == 0 ? "pipe" : "socketpair");
+            exit(1);
+        }
+        const std::string name = kind == 0 ? "pipe" : "socketpair";
+        for(size_t b = 0; b < sizeof(kBlockSizes) / sizeof(kBlockSizes[0]); b++) {
+            for(size_t f = 0; f < sizeof(kFragmentSizes) / sizeof(kFragmentSizes[0]); f++) {
+                const int block_size = kBlockSizes[b];
+                const int fragment_size = kFragmentSizes[f];
+                if(fragment_size > block_size) {
+                    continue;
+                }
+                BenchFd(iterations, name, fds, payload, block_size, fragment_size, true, NULL);
+                if(fragment_size < 1024) {
+                    BenchFd(iterations, name, fds, payload, block_size, fragment_size, false, NULL);
+                }
+            }
+        }
+        if(reader.available()) {
+            BenchFd(iterations, name, fds, payload, 4 << 10, 4 << 10, true, &reader);
+        }
+        close(fds[0]);
+        close(fds[1]);
+    }
+}
+
+// The differential stress test: two IOBuffers and their flat models.
+class Stress {
+public:
+    explicit Stress(unsigned seed)
+        : seed_(seed),
+          rng_(seed),
+          op_(0),
+          ballast_(),
+          memory_low_(0),
+          memory_high_(0),
+          memory_above_(false),
+          memory_reports_(0),
+          buffer_above_(false),
+          buffer_reports_(0)
+    {
+        if(pipe(fds_) != 0 || ! MakeNonBlocking(fds_[0]) || ! MakeNonBlocking(fds_[1])) {
+            fprintf(stderr, "can not create pipe\n");
+            exit(1);
+        }
+    }
+
+    ~Stress()
+    {
+        close(fds_[0]);
+        close(fds_[1]);
+    }
+
+    bool Run(int ops);
+
+private:
+    int Random(int n) { return n > 0 ? int(rng_() % n) : 0; }
+
+    // mostly small sizes, sometimes a few blocks' worth.
+    int RandomSize()
+    {
+        return Random(4) == 0 ? Random(3 * IOBufferData::default_buffer_size()) : Random(200);
+    }
+
+    std::string RandomBytes(int n)
+    {
+        std::string bytes(n, '\0');
+        for(int i = 0; i < n; i++) {
+            bytes[i] = char(rng_());
+        }
+        return bytes;
+    }
+
+    bool Step(IOBuffer* buf, std::string* model, IOBuffer* other, std::string* other_model);
+    bool Check(const IOBuffer& buf, const std::string& model, const char* what);
+    bool CheckWatermarks(const std::string& model);
+    bool Fail(const char* what, const char* detail);
+
+    // the process-wide callback: it frees the ballast when the usage goes
+    // above the high watermark, and so comes back into the accounting.
+    void OnMemory(bool above_high);
+
+    const unsigned seed_;
+    std::mt19937 rng_;
+    int op_;
+    int fds_[2];
+
+    IOBuffer ballast_;
+    int64_t memory_low_;
+    int64_t memory_high_;
+    bool memory_above_;     // as last reported to OnMemory()
+    int memory_reports_;
+    bool buffer_above_;     // as last reported by the watermarks of buffer a
+    int buffer_reports_;
+};
+
+bool Stress::Check(const IOBuffer& buf, const std::string& model, const char* what)
+{
+    std::string contents(buf.BytesConsumable(), '\0');
+    const int ncopied = buf.CopyOut(&contents[0], contents.size());
+
+    std::string segments;
+    for(IOBuffer::SegmentIterator it(buf); ! it.Done(); it.Next()) {
+        segments.append(it.data(), it.size());
+    }
+
+    if(buf.BytesConsumable() != int(model.size()) || ncopied != int(model.size()) ||
+            contents != model || segments != model) {
+        char detail[64];
+        snprintf(detail, sizeof(detail), "%d bytes, model %zu", buf.BytesConsumable(), model.size());
+        return Fail(what, detail);
+    }
+    return true;
+}
+
+// buffer a has watermarks at 4KB and 16KB, the process at 32KB and 64KB
+// above what was in use before the run. Freeing a big ballast from the
+// callback often takes the usage back below the low one at once.
+static const int kBufferLowWatermark = 4 << 10;
+static const int kBufferHighWatermark = 16 << 10;
+
+bool Stress::CheckWatermarks(const std::string& model)
+{
+    // between the watermarks the state is whatever was crossed last.
+    const int size = int(model.size());
+    if(buffer_above_ ? size <= kBufferLowWatermark : size >= kBufferHighWatermark) {
+        return Fail("buffer watermarks", buffer_above_ ? "not below low" : "not above high");
+    }
+    const int64_t usage = IOBufferMemoryUsage();
+    if(memory_above_ != IOBufferMemoryAboveHigh() ||
+            (memory_above_ ? usage <= memory_low_ : usage >= memory_high_)) {
+        char detail[64];
+        snprintf(detail, sizeof(detail), "usage %lld, reported %s", (long long)usage,
+                memory_above_ ? "above" : "below");
+        return Fail("memory watermarks", detail);
+    }
+    return true;
+}
+
+void Stress::OnMemory(bool above_high)
+{
+    if(above_high == memory_above_) {
+        Fail("memory watermarks", "same state reported twice");
+        exit(1);
+    }
+    memory_above_ = above_high;
+    memory_reports_++;
+    if(above_high) {
+        ballast_.Clear();
+    }
+}
+
+bool Stress::Fail(const char* what, const char* detail)
+{
+    fprintf(stderr, "stress: mismatch after op %d (%s), seed %u: %s\n", op_, what, seed_, detail);
+    return false;
+}
+
+bool Stress::Step(IOBuffer* buf, std::string* model, IOBuffer* other, std::string* other_model)
+{
+    const char* what = "";
+    const int n = RandomSize();
+
+    switch(Random(12)) {
+    case 0: {
+        what = "CopyIn";
+        const std::string bytes = RandomBytes(n);
+        buf->CopyIn(bytes.data(), n);
+        *model += bytes;
+        break;
+    }
+    case 1: {
+        what = "Copy";
+        const int nb = buf->Copy(other, n);
+        *model += other_model->substr(0, nb);
+        break;
+    }
+    case 2: {
+        what = "Move";
+        const int nb = buf->Move(other, n);
+        *model += other_model->substr(0, nb);
+        other_model->erase(0, nb);
+        break;
+    }
+    case 3:
+        if(Random(2)) {
+            what = "Move all";
+            buf->Move(other);
+        } else {
+            what = "Append";
+            buf->Append(other);
+        }
+        *model += *other_model;
+        other_model->clear();
+        break;
+    case 4:
+        what = "Consume";
+        buf->Consume(n);
+        model->erase(0, n);
+        break;
+    case 5:
+        what = "Trim";
+        buf->Trim(n);
+        if(n <= 0) {
+            model->clear();
+        } else if(n < int(model->size())) {
+            model->resize(n);
+        }
+        break;
+    case 6:
+        what = "ZeroFill";
+        buf->ZeroFill(n);
+        model->append(n, '\0');
+        break;
+    case 7: {
+        what = "Clone";
+        IOBuffer* clone = buf->Clone();
+        const bool ok = Check(*clone, *model, what);
+        delete clone;
+        if(! ok) {
+            return false;
+        }
+        break;
+    }
+    case 8: {
+        what = "Peek";
+        const char* peeked = buf->Peek(n);
+        if(peeked && (n > int(model->size()) || memcmp(peeked, model->data(), n) != 0)) {
+            return Fail(what, "wrong bytes");
+        }
+        break;
+    }
+    case 9:
+        what = "Coalesce";
+        buf->SetCoalescePolicy(IOBuffer::CoalescePolicy(Random(8), Random(512), Random(2048)));
+        buf->Coalesce();
+        break;
+    case 10: {
+        what = "Write/Read";
+        // a pipe holds 64KB, more than the buffers grow to: the write goes
+        // through whole, or fails with EAGAIN if the pipe is left full.
+        const int nw = buf->Write(fds_[1]);
+        if(nw > 0) {
+            const std::string written = model->substr(0, nw);
+            model->erase(0, nw);
+            int nread = 0;
+            while(nread < nw) {
+                const int nr = other->Read(fds_[0], Random(2) ? -1 : Random(8192) + 1);
+                if(nr <= 0) {
+                    return Fail(what, "short read");
+                }
+                nread += nr;
+            }
+            *other_model += written;
+        }
+        break;
+    }
+    case 11:
+        what = "Clear";
+        buf->Clear();
+        model->clear();
+        break;
+    }
+
+    return Check(*buf, *model, what) && Check(*other, *other_model, what);
+}
+
+bool Stress::Run(int ops)
+{
+    IOBuffer a, b;
+    std::string ma, mb;
+    a.SetWatermarks(kBufferLowWatermark, kBufferHighWatermark, [this](bool above_high) {
+        buffer_above_ = above_high;
+        buffer_reports_++;
+    });
+    memory_low_ = IOBufferMemoryUsage() + (32 << 10);
+    memory_high_ = memory_low_ + (32 << 10);
+    SetIOBufferMemoryWatermarks(memory_low_, memory_high_, [this](bool above_high, int64_t) {
+        OnMemory(above_high);
+    });
+
+    bool ok = true;
+    for(op_ = 0; op_ < ops; op_++) {
+        // keep the buffers within the pipe's capacity for Write/Read.
+        ok = Random(2) ? Step(&a, &ma, &b, &mb) : Step(&b, &mb, &a, &ma);
+        if(! ok) {
+            break;
+        }
+        if(ma.size() > 24 << 10) {
+            a.Consume(ma.size() - (8 << 10));
+            ma.erase(0, ma.size() - (8 << 10));
+        }
+        if(mb.size() > 24 << 10) {
+            b.Consume(mb.size() - (8 << 10));
+            mb.erase(0, mb.size() - (8 << 10));
+        }
+        if(ballast_.IsEmpty() && Random(64) == 0) {
+            ballast_.ZeroFill(Random(128 << 10));
+        }
+        ok = CheckWatermarks(ma);
+    }
+    // a run long enough to cross them should have.
+    if(ok && ops >= 10000 && (buffer_reports_ == 0 || memory_reports_ < 2)) {
+        ok = Fail("watermarks", "never crossed");
+    }
+
+    SetIOBufferMemoryWatermarks(0, 0, IOBufferMemoryCallback());
+    ballast_.Clear();
+    return ok;
+}
+
+// Round trips through an IOBufferSplicer between pipes: Transfer() with a
+// copy, and Write() of an IOBuffer by vmsplice(2) followed by Unpin(). The
+// pipes to out_fd and copy_fd hold less than a transfer, so the splicer is
+// left with pending bytes and called again as they are read.
+class SpliceCheck {
+public:
+    explicit SpliceCheck(unsigned seed)
+        : seed_(seed),
+          rng_(seed),
+          round_(0)
+    {
+        for(int i = 0; i < 3; i++) {
+            int* fds = (i == 0 ? in_ : (i == 1 ? out_ : copy_));
+            if(pipe(fds) != 0 || ! MakeNonBlocking(fds[0]) || ! MakeNonBlocking(fds[1])) {
+                fprintf(stderr, "can not create pipe\n");
+                exit(1);
+            }
+        }
+    }
+
+    ~SpliceCheck()
+    {
+        for(int i = 0; i < 2; i++) {
+            close(in_[i]);
+            close(out_[i]);
+            close(copy_[i]);
+        }
+    }
+
+    bool Run(int rounds);
+
+private:
+    std::string RandomBytes(int n)
+    {
+        std::string bytes(n, '\0');
+        for(int i = 0; i < n; i++) {
+            bytes[i] = char(rng_());
+        }
+        return bytes;
+    }
+
+    bool Transfer(IOBufferSplicer* splicer, const std::string& bytes);
+    bool Write(IOBufferSplicer* splicer, const std::string& bytes);
+    bool Fail(const char* what, const char* detail);
+
+    // read what fd has into *received.
+    static void ReadAll(int fd, std::string* received)
+    {
+        char chunk[16 << 10];
+        ssize_t nr;
+        while((nr = read(fd, chunk, sizeof(chunk))) > 0) {
+            received->append(chunk, nr);
+        }
+    }
+
+    const unsigned seed_;
+    std::mt19937 rng_;
+    int round_;
+    int in_[2];
+    int out_[2];
+    int copy_[2];
+};
+
+bool SpliceCheck::Fail(const char* what, const char* detail)
+{
+    fprintf(stderr, "splice: %s failed in round %d, seed %u: %s\n", what, round_, seed_, detail);
+    return false;
+}
+
+bool SpliceCheck::Transfer(IOBufferSplicer* splicer, const std::string& bytes)
+{
+    // ask for exactly the bytes left to move, so Transfer() must report
+    // how many it took from in_fd.
+    std::string received, copied;
+    size_t nsent = 0;
+    int64_t nconsumed = 0;
+    for(int spins = 0; received.size() < bytes.size() || copied.size() < bytes.size(); spins++) {
+        if(spins > 100000) {
+            return Fail("Transfer", "stuck");
+        }
+        if(nsent < bytes.size()) {
+            const ssize_t nw = write(in_[1], bytes.data() + nsent, bytes.size() - nsent);
+            if(nw > 0) {
+                nsent += nw;
+            }
+        }
+        int64_t n = 0;
+        const int64_t nt = splicer->Transfer(in_[0], out_[1], bytes.size() - nconsumed, copy_[1], &n);
+        if(nt < 0 && nt != -EAGAIN) {
+            return Fail("Transfer", strerror(int(-nt)));
+        }
+        nconsumed += n;
+        ReadAll(out_[0], &received);
+        ReadAll(copy_[0], &copied);
+    }
+    if(received != bytes || copied != bytes) {
+        return Fail("Transfer", received != bytes ? "wrong bytes" : "wrong copy");
+    }
+    if(nconsumed != static_cast<int64_t>(bytes.size())) {
+        return Fail("Transfer", "wrong # of bytes consumed");
+    }
+    if(splicer->pending() != 0 || splicer->copy_pending() != 0) {
+        return Fail("Transfer", "bytes left pending");
+    }
+    return true;
+}
+
+bool SpliceCheck::Write(IOBufferSplicer* splicer, const std::string& bytes)
+{
+    // the blocks of buf end up pinned in the splicer: they are all freed
+    // by Unpin() once the pipe is empty.
+    const int64_t usage = paxoslease::IOBufferMemoryUsage();
+    {
+        IOBuffer buf;
+        for(size_t i = 0; i < bytes.size(); ) {
+            const int n = std::min<int>(bytes.size() - i, rng_() % 6000 + 1);
+            buf.CopyIn(bytes.data() + i, n);
+            i += n;
+        }
+        std::string received;
+        for(int spins = 0; received.size() < bytes.size(); spins++) {
+            if(spins > 100000) {
+                return Fail("Write", "stuck");
+            }
+            const int nw = splicer->Write(&buf, out_[1]);
+            if(nw < 0 && nw != -EAGAIN) {
+                return Fail("Write", strerror(-nw));
+            }
+            ReadAll(out_[0], &received);
+            if(rng_() % 4 == 0) {
+                splicer->Unpin();
+            }
+        }
+        if(received != bytes || ! buf.IsEmpty() || splicer->pending() != 0) {
+            return Fail("Write", received != bytes ? "wrong bytes" : "bytes left");
+        }
+    }
+    splicer->Unpin();
+    if(paxoslease::IOBufferMemoryUsage() != usage) {
+        return Fail("Unpin", "blocks still pinned");
+    }
+    return true;
+}
+
+bool SpliceCheck::Run(int rounds)
+{
+    IOBufferSplicer splicer;
+    if(! splicer.available()) {
+        fprintf(stderr, "splice: no pipes, skipped\n");
+        return true;
+    }
+    for(round_ = 0; round_ < rounds; round_++) {
+        const std::string bytes = RandomBytes(rng_() % (256 << 10) + 1);
+        if(! (rng_() % 2 ? Transfer(&splicer, bytes) : Write(&splicer, bytes))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Encode() serializes through AppendSpace(), which hands out whole free
+// blocks and trims them back: frames far below the high watermark of the
+// buffer must not report it crossed.
+bool CheckEncodeWatermarks()
+{
+    int nabove = 0, nbelow = 0;
+    IOBuffer buf;
+    buf.SetWatermarks(100, 1000, [&](bool above_high) {
+        (above_high ? nabove : nbelow)++;
+    });
+    paxoslease::PrepareRequest request;
+    request.set_ballot_number(111);
+    request.set_node_id(1);
+    for(int i = 0; i < 3; i++) {
+        Encode(request, &buf, kFrameTypeId);
+    }
+    if(nabove != 0 || nbelow != 0) {
+        fprintf(stderr, "encode: %d bytes crossed the watermarks %d times\n",
+                buf.BytesConsumable(), nabove + nbelow);
+        return false;
+    }
+    while(buf.BytesConsumable() < 1000) {
+        Encode(request, &buf, kFrameTypeId);
+    }
+    buf.Consume(buf.BytesConsumable() - 50);
+    if(nabove != 1 || nbelow != 1) {
+        fprintf(stderr, "encode: %d above and %d below, not one each\n", nabove, nbelow);
+        return false;
+    }
+    return true;
+}
+
+// The stress test with a HugePageIOBufferAllocator, installed before any
+// block exists. The region runs out during the first half, so blocks come
+// both from it and from the heap; at the end every block of the region must
+// be back on its free stack, once.
+bool StressHugePage(unsigned seed, int ops)
+{
+    static HugePageIOBufferAllocator allocator(HugePageIOBufferAllocator::kHugePageSize);
+    if(! paxoslease::SetIOBufferAllocator(&allocator)) {
+        fprintf(stderr, "stress: can not install the allocator\n");
+        return false;
+    }
+    const uint32_t num_blocks = allocator.num_blocks();
+    const uint32_t kLeft = 16;
+
+    bool ok;
+    {
+        // leaves a few blocks of the region to the first half.
+        IOBuffer reserve;
+        if(num_blocks > kLeft) {
+            reserve.ZeroFill((num_blocks - kLeft) * IOBufferData::default_buffer_size());
+        }
+        Stress stress(seed);
+        ok = stress.Run(ops / 2);
+    }
+    Stress stress(seed + 1);
+    SpliceCheck splice_check(seed);
+    ok = ok && stress.Run(ops - ops / 2) && splice_check.Run(std::max(ops / 1000, 20));
+    if(ok && num_blocks > 0 && allocator.fallbacks() == 0) {
+        fprintf(stderr, "stress: the region never ran out\n");
+        ok = false;
+    }
+
+    const uint64_t fallbacks = allocator.fallbacks();
+    std::vector<char*> blocks;
+    std::vector<bool> seen(num_blocks, false);
+    for(uint32_t i = 0; i < num_blocks; i++) {
+        char* const block = allocator.Allocate();
+        blocks.push_back(block);
+        const int index = allocator.BlockIndex(block);
+        if(index < 0 || seen[index]) {
+            fprintf(stderr, "stress: region block %d %s\n", index, index < 0 ? "missing" : "twice");
+            ok = false;
+            break;
+        }
+        seen[index] = true;
+    }
+    if(allocator.fallbacks() != fallbacks) {
+        fprintf(stderr, "stress: region blocks missing from the free stack\n");
+        ok = false;
+    }
+    for(size_t i = 0; i < blocks.size(); i++) {
+        allocator.Deallocate(blocks[i]);
+    }
+    return ok;
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    const bool hugepage = argc > 1 && strcmp(argv[1], "stress-hugepage") == 0;
+    if(argc > 1 && (strcmp(argv[1], "stress") == 0 || hugepage)) {
+        const int ops = argc > 2 ? atoi(argv[2]) : 1000000;
+        const unsigned seed = argc > 3 ? strtoul(argv[3], NULL, 10) : 42;
+        if(ops <= 0) {
+            fprintf(stderr, "usage: %s %s [ops] [seed]\n", argv[0], argv[1]);
+            return 1;
+        }
+        if(! CheckEncodeWatermarks()) {
+            return 1;
+        }
+        if(hugepage) {
+            if(! StressHugePage(seed, ops)) {
+                return 1;
+            }
+        } else {
+            Stress stress(seed);
+            SpliceCheck splice_check(seed);
+            if(! stress.Run(ops) || ! splice_check.Run(std::max(ops / 1000, 20))) {
+                return 1;
+            }
+        }
+        printf("{\n  \"benchmark\": \"io_buffer_%s\",\n  \"seed\": %u,\n  \"ops\": %d,\n"
+                "  \"result\": \"ok\"\n}\n", hugepage ? "stress_hugepage" : "stress", seed, ops);
+        return 0;
+    }
+
+    const int iterations = argc > 1 ? atoi(argv[1]) : 2000;
+    const unsigned seed = argc > 2 ? strtoul(argv[2], NULL, 10) : 42;
+    if(iterations <= 0) {
+        fprintf(stderr, "usage: %s [iterations] [seed]\n       %s stress [ops] [seed]\n"
+                "       %s stress-hugepage [ops] [seed]\n", argv[0], argv[0], argv[0]);
+        return 1;
+    }
+
+    std::mt19937 rng(seed);
+    std::string payload(kPayloadSize, '\0');
+    for(int i = 0; i < kPayloadSize; i++) {
+        payload[i] = char(rng());
+    }
+
+    printf("{\n  \"benchmark\": \"io_buffer\",\n  \"seed\": %u,\n  \"default_block_size\": %d,\n"
+            "  \"results\": [", seed, IOBufferData::default_buffer_size());
+    for(size_t f = 0; f < sizeof(kFragmentSizes) / sizeof(kFragmentSizes[0]); f++) {
+        BenchCopyIn(iterations, payload, kFragmentSizes[f]);
+    }
+    for(size_t b = 0; b < sizeof(kBlockSizes) / sizeof(kBlockSizes[0]); b++) {
+        for(size_t f = 0; f < sizeof(kFragmentSizes) / sizeof(kFragmentSizes[0]); f++) {
+            if(kFragmentSizes[f] <= kBlockSizes[b]) {
+                BenchBuffer(iterations, payload, kBlockSizes[b], kFragmentSizes[f]);
+            }
+        }
+    }
+    BenchFds(iterations, payload);
+    printf("\n  ],\n  \"sink\": %llu\n}\n", (unsigned long long)s_sink);
+
+    Stress stress(seed);
+    SpliceCheck splice_check(seed);
+    return stress.Run(20000) && splice_check.Run(20) && CheckEncodeWatermarks() ? 0 : 1;
+}
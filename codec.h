@@ -2,15 +2,43 @@
 //  protobuf message format:
 //
 //  +----------------------+
-//  +   head_length        +  32bit
+//  +   head_word          +  32bit: format(8bit) | head_length(24bit)
 //  +----------------------+
-//  +   type_name_length   +  32bit
-//  +----------------------+
-//  +   type_name + '\0'   +   
+//  +   type               +
 //  +----------------------+
 //  +   message            +
 //  +----------------------+
 //
+//  head_length is the # of bytes following the head word. The format
+//  selects how the type is carried:
+//
+//  kFrameTypeName (0):               kFrameTypeId (1):
+//  +----------------------+          +----------------------+
+//  +   type_name_length   +  32bit   +   type_id            +  varint
+//  +----------------------+          +----------------------+
+//  +   type_name + '\0'   +
+//  +----------------------+
+//
+//  kFrameFixed (2):
+//  +----------------------+
+//  +   type_id            +  8bit
+//  +----------------------+
+//  +   fixed layout       +  FixedLayout<T>::kSize, instead of protobuf
+//  +----------------------+
+//
+//  type_id comes from MessageRegistry. Frames written before the format
+//  existed have a zero high byte and decode as kFrameTypeName.
+//
+//  With kFrameChecksum set in the format byte, the frame ends with the
+//  CRC32C of everything before it, head word included, and head_length
+//  counts it:
+//
+//  +----------------------+
+//  +   crc32c             +  32bit
+//  +----------------------+
+//
+//  The checksum is verified before the message is parsed.
+//
 /////////////////////////////////
 
 #ifndef PAXOSLEASE_CODEC_H_
@@ -19,91 +47,486 @@
 #include <arpa/inet.h> //htonl, ntohl
 #include <string>
 #include <algorithm>
+#include <limits>
+
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
 
 #include "message.pb.h"
+#include "crc32c.h"
+#include "message_registry.h"
+#include "fixed_layout.h"
+#include "message_pool.h"
+#include "io_buffer.h"
+#include "io_buffer_stream.h"
 
 const int kHeadLengthSpace = sizeof(int32_t);
 const int kTypeNameLengthSpace = sizeof(int32_t);
 
-inline std::string Encode(const google::protobuf::Message& message)
+enum FrameFormat
 {
-    std::string result;
+    kFrameTypeName = 0,
+    kFrameTypeId   = 1,
+    kFrameFixed    = 2
+};
+
+const int kFrameChecksum = 0x80;
+const int kFrameFormatMask = 0x7f;
 
-    result.resize(kHeadLengthSpace);
+const int kFrameFormatShift = 24;
+const int32_t kMaxHeadLength = (1 << kFrameFormatShift) - 1;
+const int kFixedTypeIdSpace = sizeof(uint8_t);
+const int kChecksumSpace = sizeof(uint32_t);
 
-    const std::string& type_name = message.GetTypeName();
-    int32_t type_name_length = static_cast<int32_t>(type_name.size() + 1);
-    int32_t be32 = ::htonl(type_name_length);
-    result.append(reinterpret_cast<char*>(&be32), sizeof(be32));
-    result.append(type_name.c_str(), type_name_length);
-    
-    bool succeed = message.AppendToString(&result);
-    if(succeed) 
+inline int32_t BufToInt32(const char* buf)
+{
+    int32_t be32 = 0;
+    ::memcpy(&be32, buf, sizeof(be32));
+    return ::ntohl(be32);
+}
+
+// Write message as a frame into output. A message outside of
+// MessageRegistry is always framed by its type name, and one without a
+// FixedLayout by its type id. With checksum, the frame is flagged and sized
+// for a checksum trailer, which is left for the caller to append.
+inline bool EncodeToCodedStream(const google::protobuf::Message& message, FrameFormat format, bool checksum,
+        google::protobuf::io::CodedOutputStream* output)
+{
+    const uint32_t flags = checksum ? kFrameChecksum : 0;
+    const size_t trailer_length = checksum ? kChecksumSpace : 0;
+
+    const google::protobuf::Descriptor* descriptor = message.GetDescriptor();
+    const int type_id = paxoslease::MessageRegistry::Instance().TypeId(descriptor);
+    if(type_id == paxoslease::MessageRegistry::kInvalidTypeId)
+    {
+        format = kFrameTypeName;
+    }
+
+    if(format == kFrameFixed)
+    {
+        const paxoslease::FixedLayoutEntry* layout = paxoslease::FixedLayoutTable::Instance().Find(type_id);
+        if(layout)
+        {
+            char buf[kHeadLengthSpace + kFixedTypeIdSpace + paxoslease::kMaxFixedLayoutSize];
+            const uint32_t head_word = ((kFrameFixed | flags) << kFrameFormatShift) |
+                (kFixedTypeIdSpace + layout->size + trailer_length);
+            const uint32_t be32 = ::htonl(head_word);
+            ::memcpy(buf, &be32, sizeof(be32));
+            buf[kHeadLengthSpace] = static_cast<char>(type_id);
+            layout->write(message, buf + kHeadLengthSpace + kFixedTypeIdSpace);
+            output->WriteRaw(buf, kHeadLengthSpace + kFixedTypeIdSpace + layout->size);
+            return !output->HadError();
+        }
+        format = kFrameTypeId;
+    }
+
+    const std::string& type_name = descriptor->full_name();
+    const int32_t type_name_length = static_cast<int32_t>(type_name.size() + 1);
+    const size_t byte_size = message.ByteSizeLong();
+
+    size_t head_length = byte_size + trailer_length;
+    if(format == kFrameTypeId)
+    {
+        head_length += google::protobuf::io::CodedOutputStream::VarintSize32(type_id);
+    }
+    else
     {
-        int32_t head_length = ::htonl(result.size() - kHeadLengthSpace);
-        std::copy(reinterpret_cast<char*>(&head_length), reinterpret_cast<char*>(&head_length) + sizeof(head_length), result.begin());
-        return result;
-    } 
-    else 
+        head_length += kTypeNameLengthSpace + type_name_length;
+    }
+    if(head_length > static_cast<size_t>(kMaxHeadLength))
+    {
+        return false;
+    }
+
+    const uint32_t head_word = ((format | flags) << kFrameFormatShift) | head_length;
+    uint32_t be32 = ::htonl(head_word);
+    output->WriteRaw(&be32, sizeof(be32));
+    if(format == kFrameTypeId)
+    {
+        output->WriteVarint32(type_id);
+    }
+    else
+    {
+        be32 = ::htonl(type_name_length);
+        output->WriteRaw(&be32, sizeof(be32));
+        output->WriteRaw(type_name.c_str(), type_name_length);
+    }
+    message.SerializeWithCachedSizes(output);
+
+    return !output->HadError();
+}
+
+// CRC32C of length bytes of buf starting at offset.
+inline uint32_t IOBufferCrc32c(const paxoslease::IOBuffer& buf, int offset, int length)
+{
+    uint32_t crc = 0;
+    for(paxoslease::IOBuffer::SegmentIterator it(buf, offset); length > 0 && !it.Done(); it.Next())
+    {
+        const int n = std::min(it.size(), length);
+        crc = paxoslease::Crc32cExtend(crc, it.data(), n);
+        length -= n;
+    }
+    return crc;
+}
+
+inline std::string Encode(const google::protobuf::Message& message, FrameFormat format = kFrameTypeName,
+        bool checksum = false)
+{
+    std::string result;
+    bool succeed = false;
+    if(message.IsInitialized())
+    {
+        google::protobuf::io::StringOutputStream stream(&result);
+        google::protobuf::io::CodedOutputStream output(&stream);
+        succeed = EncodeToCodedStream(message, format, checksum, &output);
+    }
+    if(succeed && checksum)
+    {
+        const uint32_t be32 = ::htonl(paxoslease::Crc32c(result.data(), result.size()));
+        result.append(reinterpret_cast<const char*>(&be32), sizeof(be32));
+    }
+    if(!succeed)
     {
         result.clear();
     }
     return result;
 }
 
-inline int32_t BufToInt32(const char* buf)
+// Encode message as a frame appended to buf. The size of the message is
+// computed up front so the header is written once, and the payload is
+// serialized straight into the IOBufferData blocks of buf without any
+// intermediate string. Returns the # of bytes appended, or -1 on failure in 
+// which case buf is left unchanged.
+inline int Encode(const google::protobuf::Message& message, paxoslease::IOBuffer* buf,
+        FrameFormat format = kFrameTypeName, bool checksum = false)
 {
-    int32_t be32 = 0;
-    ::memcpy(&be32, buf, sizeof(be32));
-    return ::ntohl(be32);
+    if(!buf || !message.IsInitialized())
+    {
+        return -1;
+    }
+
+    const int orig_length = buf->BytesConsumable();
+    bool succeed = false;
+    {
+        paxoslease::IOBufferOutputStream stream(buf);
+        google::protobuf::io::CodedOutputStream output(&stream);
+        succeed = EncodeToCodedStream(message, format, checksum, &output);
+    }
+    if(succeed && checksum)
+    {
+        const int frame_length = buf->BytesConsumable() - orig_length;
+        const uint32_t be32 = ::htonl(IOBufferCrc32c(*buf, orig_length, frame_length));
+        succeed = buf->CopyIn(reinterpret_cast<const char*>(&be32), sizeof(be32)) == sizeof(be32);
+    }
+    if(!succeed)
+    {
+        buf->Trim(orig_length);
+        return -1;
+    }
+    return buf->BytesConsumable() - orig_length;
 }
 
-inline google::protobuf::Message* Name2ProtobufMessage(const std::string& type_name)
-{  
-    google::protobuf::Message* message = NULL;
+inline const google::protobuf::Message* Name2Prototype(const std::string& type_name)
+{
+    const google::protobuf::Message* prototype = NULL;
     const google::protobuf::Descriptor* descriptor =
         google::protobuf::DescriptorPool::generated_pool()->FindMessageTypeByName(type_name);
     if(descriptor) 
     {
-        const google::protobuf::Message* prototype = 
-            google::protobuf::MessageFactory::generated_factory()->GetPrototype(descriptor);
-        if(prototype) 
+        prototype = google::protobuf::MessageFactory::generated_factory()->GetPrototype(descriptor);
+    }
+    return prototype;
+}
+
+inline google::protobuf::Message* Name2ProtobufMessage(const std::string& type_name)
+{  
+    const google::protobuf::Message* prototype = Name2Prototype(type_name);
+    return prototype ? prototype->New() : NULL;
+}
+
+// Read the head word of a frame out of input. format keeps the
+// kFrameChecksum flag.
+inline bool DecodeHeadWord(google::protobuf::io::CodedInputStream* input, int* format, int32_t* head_length)
+{
+    uint32_t be32 = 0;
+    if(!input->ReadRaw(&be32, sizeof(be32)))
+    {
+        return false;
+    }
+    const uint32_t head_word = ::ntohl(be32);
+    *format = head_word >> kFrameFormatShift;
+    *head_length = head_word & kMaxHeadLength;
+    const int base_format = *format & kFrameFormatMask;
+    return base_format == kFrameTypeName || base_format == kFrameTypeId || base_format == kFrameFixed;
+}
+
+// Read the type of a frame whose head word was already read and resolve the
+// prototype of the message that follows.
+inline bool DecodeFrameType(google::protobuf::io::CodedInputStream* input, int format, int32_t head_length,
+        const google::protobuf::Message** prototype, int* payload_length)
+{
+    if(format == kFrameTypeId)
+    {
+        const int start = input->CurrentPosition();
+        uint32_t type_id = 0;
+        if(!input->ReadVarint32(&type_id))
         {
-            message = prototype->New();
+            return false;
         }
+        *prototype = paxoslease::MessageRegistry::Instance().Prototype(type_id);
+        *payload_length = head_length - (input->CurrentPosition() - start);
     }
-    return message;
+    else if(format == kFrameFixed)
+    {
+        uint8_t type_id = 0;
+        if(head_length < kFixedTypeIdSpace || !input->ReadRaw(&type_id, sizeof(type_id)))
+        {
+            return false;
+        }
+        *prototype = paxoslease::MessageRegistry::Instance().Prototype(type_id);
+        *payload_length = head_length - kFixedTypeIdSpace;
+    }
+    else if(format == kFrameTypeName)
+    {
+        uint32_t be32 = 0;
+        if(head_length < kTypeNameLengthSpace || !input->ReadRaw(&be32, sizeof(be32)))
+        {
+            return false;
+        }
+        const int32_t type_name_length = ::ntohl(be32);
+        if(type_name_length <= 0 || type_name_length > head_length - kTypeNameLengthSpace)
+        {
+            return false;
+        }
 
+        std::string type_name;
+        if(!input->ReadString(&type_name, type_name_length))
+        {
+            return false;
+        }
+        type_name.resize(type_name_length - 1); // drop the trailing '\0'
+
+        *prototype = Name2Prototype(type_name);
+        *payload_length = head_length - kTypeNameLengthSpace - type_name_length;
+    }
+    else
+    {
+        return false;
+    }
+    return *prototype != NULL && *payload_length >= 0;
 }
 
-inline google::protobuf::Message* Decode(const std::string& buf)
+// Parse exactly payload_length bytes of input into message.
+inline bool DecodePayload(google::protobuf::io::CodedInputStream* input, int payload_length,
+        google::protobuf::Message* message)
 {
-    google::protobuf::Message* result = NULL;
-    
-    int32_t length = static_cast<int32_t>(buf.size());
-    if(length >= kHeadLengthSpace + kTypeNameLengthSpace)
-    {
-        int32_t head_length = BufToInt32(buf.c_str());
-        
-        int32_t type_name_length = BufToInt32(buf.c_str() + kHeadLengthSpace);
+    google::protobuf::io::CodedInputStream::Limit limit = input->PushLimit(payload_length);
+    const bool succeed = message->ParseFromCodedStream(input) && input->BytesUntilLimit() == 0;
+    input->PopLimit(limit);
+    return succeed;
+}
+
+// Decode the type and message of a frame, the head_length bytes following
+// the head word minus any checksum trailer.
+inline paxoslease::MessagePtr DecodeFrameContent(google::protobuf::io::CodedInputStream* input, int format,
+        int32_t head_length, paxoslease::MessagePool* pool)
+{
+    const google::protobuf::Message* prototype = NULL;
+    int payload_length = 0;
+    paxoslease::MessagePtr message;
 
-        if(length >= type_name_length + kHeadLengthSpace + kTypeNameLengthSpace)
+    // never read past the end of the frame, whatever its type says.
+    google::protobuf::io::CodedInputStream::Limit limit = input->PushLimit(head_length);
+    if(DecodeFrameType(input, format, head_length, &prototype, &payload_length))
+    {
+        message = pool ? pool->Acquire(prototype) : paxoslease::MessagePtr(prototype->New());
+        if(format == kFrameFixed)
         {
-            const std::string type_name(buf.begin() + kHeadLengthSpace + kTypeNameLengthSpace, buf.begin() + kHeadLengthSpace + kTypeNameLengthSpace + type_name_length);
-            google::protobuf::Message* message =  Name2ProtobufMessage(type_name);
-            
-            const char* data = buf.c_str() + kHeadLengthSpace + kTypeNameLengthSpace + type_name_length;
-            if(message->ParseFromArray(data, head_length- kTypeNameLengthSpace - type_name_length)) 
+            const paxoslease::FixedLayoutEntry* layout = paxoslease::FixedLayoutTable::Instance().Find(
+                    paxoslease::MessageRegistry::Instance().TypeId(prototype->GetDescriptor()));
+            char buf[paxoslease::kMaxFixedLayoutSize];
+            if(layout && layout->size == payload_length && input->ReadRaw(buf, payload_length))
             {
-                result = message;
-            } 
+                layout->read(buf, message.get());
+            }
             else
             {
-                delete message;
+                message.reset();
             }
-        } 
+        }
+        else if(!DecodePayload(input, payload_length, message.get()))
+        {
+            message.reset();
+        }
     }
-    return result;
+    input->PopLimit(limit);
+    return message;
+}
+
+// Decode the rest of a frame whose head word was already read, verifying
+// its checksum first if it has one. The message is taken from pool, or
+// allocated on the heap if pool is NULL.
+inline paxoslease::MessagePtr DecodeFrameBody(google::protobuf::io::CodedInputStream* input, int format,
+        int32_t head_length, paxoslease::MessagePool* pool)
+{
+    if(!(format & kFrameChecksum))
+    {
+        return DecodeFrameContent(input, format, head_length, pool);
+    }
+    if(head_length < kChecksumSpace)
+    {
+        return paxoslease::MessagePtr();
+    }
+
+    const int content_length = head_length - kChecksumSpace;
+    const uint32_t head_word = ::htonl((static_cast<uint32_t>(format) << kFrameFormatShift) | head_length);
+    const uint32_t head_crc = paxoslease::Crc32c(&head_word, sizeof(head_word));
+    paxoslease::MessagePtr message;
+
+    google::protobuf::io::CodedInputStream::Limit limit = input->PushLimit(head_length);
+    const void* data = NULL;
+    int size = 0;
+    if(input->GetDirectBufferPointer(&data, &size) && size >= head_length)
+    {
+        // the frame sits in one block: check it in place, then parse it.
+        const char* frame = static_cast<const char*>(data);
+        if(paxoslease::Crc32cExtend(head_crc, frame, content_length) ==
+                static_cast<uint32_t>(BufToInt32(frame + content_length)))
+        {
+            message = DecodeFrameContent(input, format & kFrameFormatMask, content_length, pool);
+            if(message && !input->Skip(kChecksumSpace))
+            {
+                message.reset();
+            }
+        }
+    }
+    else
+    {
+        // the frame spans blocks: gather it to check it.
+        std::string frame;
+        if(input->ReadString(&frame, head_length) &&
+                paxoslease::Crc32cExtend(head_crc, frame.data(), content_length) ==
+                static_cast<uint32_t>(BufToInt32(frame.data() + content_length)))
+        {
+            google::protobuf::io::CodedInputStream frame_input(
+                    reinterpret_cast<const uint8_t*>(frame.data()), content_length);
+            message = DecodeFrameContent(&frame_input, format & kFrameFormatMask, content_length, pool);
+        }
+    }
+    input->PopLimit(limit);
+    return message;
+}
+
+// Parse one frame out of input, which holds length bytes. The frame is
+// validated against length before anything is allocated or parsed.
+inline paxoslease::MessagePtr DecodeFromCodedStream(google::protobuf::io::CodedInputStream* input, int length,
+        paxoslease::MessagePool* pool)
+{
+    int format = 0;
+    int32_t head_length = 0;
+    if(length < kHeadLengthSpace || !DecodeHeadWord(input, &format, &head_length) ||
+            head_length > length - kHeadLengthSpace)
+    {
+        return paxoslease::MessagePtr();
+    }
+    return DecodeFrameBody(input, format, head_length, pool);
+}
+
+inline google::protobuf::Message* DecodeFromCodedStream(google::protobuf::io::CodedInputStream* input, int length)
+{
+    return DecodeFromCodedStream(input, length, NULL).release();
+}
+
+inline google::protobuf::Message* Decode(const std::string& buf)
+{
+    google::protobuf::io::CodedInputStream input(
+            reinterpret_cast<const uint8_t*>(buf.data()), static_cast<int>(buf.size()));
+    return DecodeFromCodedStream(&input, static_cast<int>(buf.size()));
+}
+
+// Decode a frame straight out of the IOBufferData blocks of buf, frames
+// spanning block boundaries included, without flattening it first. 
+// The buffer is not consumed.
+inline google::protobuf::Message* Decode(const paxoslease::IOBuffer& buf)
+{
+    paxoslease::IOBufferInputStream stream(&buf);
+    google::protobuf::io::CodedInputStream input(&stream);
+    return DecodeFromCodedStream(&input, buf.BytesConsumable());
+}
+
+// The pooled variants hand back an owning handle that returns the message to
+// pool when it goes out of scope, so a steady flow of frames decodes without
+// heap allocations.
+inline paxoslease::MessagePtr Decode(const std::string& buf, paxoslease::MessagePool* pool)
+{
+    google::protobuf::io::CodedInputStream input(
+            reinterpret_cast<const uint8_t*>(buf.data()), static_cast<int>(buf.size()));
+    return DecodeFromCodedStream(&input, static_cast<int>(buf.size()), pool);
+}
+
+inline paxoslease::MessagePtr Decode(const paxoslease::IOBuffer& buf, paxoslease::MessagePool* pool)
+{
+    paxoslease::IOBufferInputStream stream(&buf);
+    google::protobuf::io::CodedInputStream input(&stream);
+    return DecodeFromCodedStream(&input, buf.BytesConsumable(), pool);
+}
+
+// The typed fixed codec: a kFrameFixed frame is written or read with
+// compile-time sizes and the generated accessors only. Both directions
+// are wire compatible with Encode(message, kFrameFixed) and Decode().
+template <typename T>
+inline int FixedFrameSize()
+{
+    return kHeadLengthSpace + kFixedTypeIdSpace + paxoslease::FixedLayout<T>::kSize;
+}
+
+template <typename T>
+inline int FixedTypeId()
+{
+    static const int type_id = paxoslease::MessageRegistry::Instance().TypeId(T::descriptor());
+    return type_id;
+}
+
+// Write the frame for message into buf, which must hold FixedFrameSize<T>()
+// bytes. Returns the # of bytes written.
+template <typename T>
+inline int EncodeFixed(const T& message, char* buf)
+{
+    const uint32_t head_word = (static_cast<uint32_t>(kFrameFixed) << kFrameFormatShift) |
+        (kFixedTypeIdSpace + paxoslease::FixedLayout<T>::kSize);
+    const uint32_t be32 = ::htonl(head_word);
+    ::memcpy(buf, &be32, sizeof(be32));
+    buf[kHeadLengthSpace] = static_cast<char>(FixedTypeId<T>());
+    paxoslease::FixedLayout<T>::Write(message, buf + kHeadLengthSpace + kFixedTypeIdSpace);
+    return FixedFrameSize<T>();
+}
+
+template <typename T>
+inline int EncodeFixed(const T& message, paxoslease::IOBuffer* buf)
+{
+    char frame[kHeadLengthSpace + kFixedTypeIdSpace + paxoslease::FixedLayout<T>::kSize];
+    return buf->CopyIn(frame, EncodeFixed(message, frame));
+}
+
+// Read a fixed frame of type T out of buf, which holds length bytes. Fails
+// if the frame is not a fixed frame of exactly that type.
+template <typename T>
+inline bool DecodeFixed(const char* buf, int length, T* message)
+{
+    if(length < FixedFrameSize<T>())
+    {
+        return false;
+    }
+    const uint32_t head_word = (static_cast<uint32_t>(kFrameFixed) << kFrameFormatShift) |
+        (kFixedTypeIdSpace + paxoslease::FixedLayout<T>::kSize);
+    uint32_t be32 = 0;
+    ::memcpy(&be32, buf, sizeof(be32));
+    if(::ntohl(be32) != head_word || static_cast<uint8_t>(buf[kHeadLengthSpace]) != FixedTypeId<T>())
+    {
+        return false;
+    }
+    paxoslease::FixedLayout<T>::Read(buf + kHeadLengthSpace + kFixedTypeIdSpace, message);
+    return true;
 }
 
 #endif //PAXOSLEASE_CODEC_H_
@@ -0,0 +1,111 @@
+#include "crc32c.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define PAXOSLEASE_CRC32C_SSE42 1
+#endif
+
+namespace paxoslease {
+
+static const uint32_t kCrc32cPoly = 0x82f63b78; // reflected Castagnoli
+
+class Crc32cTable {
+public:
+    Crc32cTable()
+    {
+        for(uint32_t i = 0; i < 256; i++) {
+            uint32_t crc = i;
+            for(int k = 0; k < 8; k++) {
+                crc = (crc >> 1) ^ (kCrc32cPoly & (0 - (crc & 1)));
+            }
+            table_[i] = crc;
+        }
+    }
+
+    uint32_t operator [](size_t i) const { return table_[i]; }
+
+private:
+    uint32_t table_[256];
+};
+
+static const Crc32cTable s_crc32c_table;
+
+static uint32_t Crc32cPortable(uint32_t crc, const uint8_t* p, size_t n)
+{
+    uint32_t l = crc ^ 0xffffffffu;
+    for(size_t i = 0; i < n; i++) {
+        l = s_crc32c_table[(l ^ p[i]) & 0xff] ^ (l >> 8);
+    }
+    return l ^ 0xffffffffu;
+}
+
+#ifdef PAXOSLEASE_CRC32C_SSE42
+
+__attribute__((target("sse4.2")))
+static uint32_t Crc32cSse42(uint32_t crc, const uint8_t* p, size_t n)
+{
+    uint32_t l = crc ^ 0xffffffffu;
+
+    // byte at a time up to an 8 byte boundary, then 8 bytes at a time.
+    while(n > 0 && (reinterpret_cast<uintptr_t>(p) & 7) != 0) {
+        l = _mm_crc32_u8(l, *p++);
+        n--;
+    }
+#ifdef __x86_64__
+    uint64_t l64 = l;
+    while(n >= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        l64 = _mm_crc32_u64(l64, v);
+        p += 8;
+        n -= 8;
+    }
+    l = static_cast<uint32_t>(l64);
+#endif
+    while(n >= 4) {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        l = _mm_crc32_u32(l, v);
+        p += 4;
+        n -= 4;
+    }
+    while(n > 0) {
+        l = _mm_crc32_u8(l, *p++);
+        n--;
+    }
+    return l ^ 0xffffffffu;
+}
+
+static bool CanUseSse42()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2");
+}
+
+static const bool s_crc32c_sse42 = CanUseSse42();
+
+#else
+
+static const bool s_crc32c_sse42 = false;
+
+#endif // PAXOSLEASE_CRC32C_SSE42
+
+uint32_t Crc32cExtend(uint32_t crc, const void* data, size_t n)
+{
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+#ifdef PAXOSLEASE_CRC32C_SSE42
+    if(s_crc32c_sse42) {
+        return Crc32cSse42(crc, p, n);
+    }
+#endif
+    return Crc32cPortable(crc, p, n);
+}
+
+bool Crc32cIsAccelerated()
+{
+    return s_crc32c_sse42;
+}
+
+} // namespace paxoslease
@@ -0,0 +1,25 @@
+#ifndef PAXOSLEASE_CRC32C_H
+#define PAXOSLEASE_CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace paxoslease {
+
+/// Extend crc, the CRC32C (Castagnoli) of some data, with n more bytes.
+/// Uses the SSE4.2 crc32 instruction when the CPU has it, and a table
+/// driven implementation otherwise.
+uint32_t Crc32cExtend(uint32_t crc, const void* data, size_t n);
+
+/// CRC32C of n bytes.
+inline uint32_t Crc32c(const void* data, size_t n)
+{
+    return Crc32cExtend(0, data, n);
+}
+
+/// Whether Crc32cExtend runs on the hardware instruction.
+bool Crc32cIsAccelerated();
+
+} // namespace paxoslease
+
+#endif //PAXOSLEASE_CRC32C_H
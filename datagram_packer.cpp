@@ -0,0 +1,129 @@
+#include "datagram_packer.h"
+
+#include <assert.h>
+#include <utility>
+
+#include "io_buffer_stream.h"
+
+namespace paxoslease {
+
+DatagramPacker::DatagramPacker(UdpSocket* socket, int mtu, FrameFormat format, bool checksum)
+    : socket_(socket),
+      mtu_(mtu),
+      format_(format),
+      checksum_(checksum),
+      pending_(),
+      frames_pending_(0)
+{
+    assert(socket_ && mtu_ > 0);
+}
+
+DatagramPacker::~DatagramPacker()
+{
+}
+
+int DatagramPacker::Broadcast(const google::protobuf::Message& message)
+{
+    const int orig_length = pending_.BytesConsumable();
+    const int nbytes = Encode(message, &pending_, format_, checksum_);
+    if(nbytes < 0) {
+        return -1;
+    }
+
+    if(orig_length > 0 && orig_length + nbytes > mtu_) {
+        // the new frame does not fit: send what was pending before it. The
+        // new frame stays queued whether that send succeeds or not.
+        IOBuffer datagram;
+        datagram.Move(&pending_, orig_length);
+        const int nsent = socket_->Broadcast(&datagram);
+        frames_pending_ = 1;
+        return nsent < 0 ? nsent : 0;
+    }
+    frames_pending_++;
+
+    return 0;
+}
+
+int DatagramPacker::Flush()
+{
+    if(pending_.IsEmpty()) {
+        return 0;
+    }
+    const int nsent = socket_->Broadcast(&pending_);
+    pending_.Clear();
+    frames_pending_ = 0;
+    return nsent;
+}
+
+template <typename Sink>
+static int UnpackFrames(const IOBuffer& datagram, MessagePool* pool, Sink& sink, int* frames_dropped)
+{
+    IOBufferInputStream stream(&datagram);
+    google::protobuf::io::CodedInputStream input(&stream);
+
+    const int length = datagram.BytesConsumable();
+    int consumed = 0;
+    int nunpacked = 0;
+    int ndropped = 0;
+    while(consumed < length) {
+        int format = 0;
+        int32_t head_length = 0;
+        if(length - consumed < kHeadLengthSpace || ! DecodeHeadWord(&input, &format, &head_length) ||
+                head_length > length - consumed - kHeadLengthSpace) {
+            nunpacked = -1;
+            break;
+        }
+
+        // a frame that does not decode is dropped; its head word still
+        // tells where the next one starts.
+        MessagePtr message = DecodeFrameBody(&input, format, head_length, pool);
+        const int frame_length = kHeadLengthSpace + head_length;
+        consumed += frame_length;
+        const int skip = consumed - input.CurrentPosition();
+        assert(skip >= 0);
+        if(skip > 0 && ! input.Skip(skip)) {
+            nunpacked = -1;
+            break;
+        }
+        if(message) {
+            sink(std::move(message), frame_length);
+            nunpacked++;
+        } else {
+            ndropped++;
+        }
+    }
+    if(frames_dropped) {
+        *frames_dropped = ndropped;
+    }
+    return nunpacked;
+}
+
+namespace {
+
+struct AppendSink {
+    std::vector<MessagePtr>* messages;
+    void operator ()(MessagePtr message, int) { messages->push_back(std::move(message)); }
+};
+
+struct DispatchSink {
+    const ProtobufDispatcher* dispatcher;
+    void operator ()(MessagePtr message, int bytes) { dispatcher->OnMessage(message.get(), bytes); }
+};
+
+} // namespace
+
+int UnpackDatagram(const IOBuffer& datagram, MessagePool* pool, std::vector<MessagePtr>* messages,
+        int* frames_dropped)
+{
+    AppendSink sink = { messages };
+    return UnpackFrames(datagram, pool, sink, frames_dropped);
+}
+
+int UnpackDatagram(const IOBuffer& datagram, MessagePool* pool, const ProtobufDispatcher& dispatcher,
+        int* frames_dropped)
+{
+    DispatchSink sink = { &dispatcher };
+    return UnpackFrames(datagram, pool, sink, frames_dropped);
+}
+
+} // namespace paxoslease
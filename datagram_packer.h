@@ -0,0 +1,72 @@
+#ifndef PAXOSLEASE_DATAGRAM_PACKER_H
+#define PAXOSLEASE_DATAGRAM_PACKER_H
+
+#include <vector>
+
+#include "codec.h"
+#include "dispatcher.h"
+#include "io_buffer.h"
+#include "message_pool.h"
+#include "udpsocket.h"
+
+namespace paxoslease {
+
+/// Packs consecutive broadcast messages into as few datagrams as possible:
+/// frames are encoded back to back into a pending datagram, which is sent
+/// when the next frame would push it over mtu bytes, or on Flush(). Call
+/// Flush() once per event loop iteration after all replies are queued.
+///
+/// A single frame larger than mtu is sent in a datagram of its own.
+class DatagramPacker {
+public:
+    /// Ethernet MTU minus IPv4 and UDP headers.
+    static const int kDefaultMtu = 1500 - 20 - 8;
+
+    explicit DatagramPacker(UdpSocket* socket, int mtu = kDefaultMtu,
+            FrameFormat format = kFrameTypeId, bool checksum = false);
+    ~DatagramPacker();
+
+    /// Queue message for broadcast. Returns 0 on success, -1 if the message
+    /// could not be encoded, or the error of a flush that failed. In the
+    /// latter case only the earlier datagram is lost: message stays queued.
+    int Broadcast(const google::protobuf::Message& message);
+
+    /// Send the pending datagram, if any. Returns the # of bytes sent, 0 if
+    /// nothing was pending, or -errno.
+    int Flush();
+
+    int BytesPending() const { return pending_.BytesConsumable(); }
+    int FramesPending() const { return frames_pending_; }
+
+    int mtu() const { return mtu_; }
+
+private:
+    UdpSocket* socket_;
+    const int mtu_;
+    const FrameFormat format_;
+    const bool checksum_;
+
+    IOBuffer pending_;
+    int frames_pending_;
+
+    DatagramPacker(const DatagramPacker&);
+    DatagramPacker& operator =(const DatagramPacker&);
+};
+
+/// Split a received datagram into its frames. A frame whose body does not
+/// decode (unknown type, bad checksum, unparsable payload) is skipped by its
+/// head_length and counted in frames_dropped, if given. Frames never span
+/// datagrams, so a bad head word or trailing bytes that do not form a whole
+/// frame are an error. Returns the # of messages appended, or -1 if the
+/// datagram is malformed, in which case the messages decoded before the bad
+/// head are still appended.
+int UnpackDatagram(const IOBuffer& datagram, MessagePool* pool, std::vector<MessagePtr>* messages,
+        int* frames_dropped = NULL);
+
+/// Split a received datagram and dispatch each contained message in order.
+int UnpackDatagram(const IOBuffer& datagram, MessagePool* pool, const ProtobufDispatcher& dispatcher,
+        int* frames_dropped = NULL);
+
+} // namespace paxoslease
+
+#endif //PAXOSLEASE_DATAGRAM_PACKER_H
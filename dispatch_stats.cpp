@@ -0,0 +1,164 @@
+#include "dispatch_stats.h"
+
+#include <stdio.h>
+#include <chrono>
+#include <thread>
+
+#include "message_registry.h"
+
+namespace paxoslease {
+
+uint64_t CycleClock::SteadyNanos()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static double CalibrateNanosPerTick()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    const uint64_t start_ns = CycleClock::SteadyNanos();
+    const uint64_t start_tick = CycleClock::Now();
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    const uint64_t ns = CycleClock::SteadyNanos() - start_ns;
+    const uint64_t ticks = CycleClock::Now() - start_tick;
+    return ticks > 0 ? static_cast<double>(ns) / ticks : 1.0;
+#else
+    return 1.0;
+#endif
+}
+
+double CycleClock::NanosPerTick()
+{
+    static const double nanos_per_tick = CalibrateNanosPerTick();
+    return nanos_per_tick;
+}
+
+LatencyHistogram::LatencyHistogram()
+    : sum_(0),
+      max_(0)
+{
+    for(int i = 0; i < kNumBuckets; i++) {
+        buckets_[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+void LatencyHistogram::Load(std::vector<uint64_t>* buckets, uint64_t* sum, uint64_t* max) const
+{
+    buckets->resize(kNumBuckets);
+    for(int i = 0; i < kNumBuckets; i++) {
+        (*buckets)[i] = buckets_[i].load(std::memory_order_relaxed);
+    }
+    *sum = sum_.load(std::memory_order_relaxed);
+    *max = max_.load(std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::BucketLimit(int bucket)
+{
+    if(bucket < kSubBuckets) {
+        return bucket;
+    }
+    const int shift = bucket / kSubBuckets - 1;
+    const uint64_t lower = static_cast<uint64_t>(kSubBuckets + bucket % kSubBuckets) << shift;
+    return lower + ((static_cast<uint64_t>(1) << shift) - 1);
+}
+
+DispatchStats::DispatchStats(uint32_t sample_every)
+    : sample_mask_(0),
+      types_(MessageRegistry::Instance().size())
+{
+    // round up to a power of two, so sampling is a mask test.
+    uint64_t every = 1;
+    while(every < sample_every) {
+        every <<= 1;
+    }
+    sample_mask_ = every - 1;
+
+    for(size_t i = 0; i < types_.size(); i++) {
+        types_[i].reset(new TypeStats());
+    }
+    // touch the calibration now rather than in the first snapshot.
+    CycleClock::NanosPerTick();
+}
+
+DispatchStats::~DispatchStats()
+{
+}
+
+// value of the bucket holding the rank-th smallest sample (0 based).
+static uint64_t ValueAtRank(const std::vector<uint64_t>& buckets, uint64_t rank, uint64_t max)
+{
+    uint64_t seen = 0;
+    for(size_t i = 0; i < buckets.size(); i++) {
+        seen += buckets[i];
+        if(seen > rank) {
+            const uint64_t limit = LatencyHistogram::BucketLimit(i);
+            return limit < max ? limit : max;
+        }
+    }
+    return max;
+}
+
+void DispatchStats::Snapshot(std::vector<DispatchTypeStats>* types) const
+{
+    const MessageRegistry& registry = MessageRegistry::Instance();
+    const double nanos_per_tick = CycleClock::NanosPerTick();
+    const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+    std::vector<uint64_t> buckets;
+    types->clear();
+    for(size_t type_id = 0; type_id < types_.size(); type_id++) {
+        const TypeStats& stats = *types_[type_id];
+        DispatchTypeStats snapshot = DispatchTypeStats();
+        snapshot.count = stats.count.load(std::memory_order_relaxed);
+        if(snapshot.count == 0) {
+            continue;
+        }
+        const google::protobuf::Message* prototype = registry.Prototype(type_id);
+        snapshot.type_name = prototype ? prototype->GetTypeName() : "other";
+        snapshot.bytes = stats.bytes.load(std::memory_order_relaxed);
+
+        uint64_t sum = 0;
+        uint64_t max = 0;
+        stats.latency.Load(&buckets, &sum, &max);
+        for(size_t i = 0; i < buckets.size(); i++) {
+            snapshot.samples += buckets[i];
+        }
+        if(snapshot.samples > 0) {
+            double* out[] = { &snapshot.p50_ns, &snapshot.p90_ns, &snapshot.p99_ns, &snapshot.p999_ns };
+            for(size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+                const uint64_t rank = static_cast<uint64_t>(quantiles[q] * (snapshot.samples - 1));
+                *out[q] = ValueAtRank(buckets, rank, max) * nanos_per_tick;
+            }
+            // a record racing the copy can leave sum a bit ahead of the
+            // buckets: keep the mean within max regardless.
+            const double mean = static_cast<double>(sum) / snapshot.samples;
+            snapshot.mean_ns = (mean < max ? mean : max) * nanos_per_tick;
+            snapshot.max_ns = max * nanos_per_tick;
+        }
+        types->push_back(snapshot);
+    }
+}
+
+std::string DispatchStats::ToString() const
+{
+    std::vector<DispatchTypeStats> types;
+    Snapshot(&types);
+
+    std::string out;
+    char line[512];
+    for(size_t i = 0; i < types.size(); i++) {
+        const DispatchTypeStats& t = types[i];
+        snprintf(line, sizeof(line),
+                "{\"type\": \"%s\", \"count\": %llu, \"bytes\": %llu, \"samples\": %llu, "
+                "\"mean_ns\": %.1f, \"p50_ns\": %.1f, \"p90_ns\": %.1f, \"p99_ns\": %.1f, "
+                "\"p999_ns\": %.1f, \"max_ns\": %.1f}\n",
+                t.type_name.c_str(), (unsigned long long)t.count, (unsigned long long)t.bytes,
+                (unsigned long long)t.samples, t.mean_ns, t.p50_ns, t.p90_ns, t.p99_ns,
+                t.p999_ns, t.max_ns);
+        out += line;
+    }
+    return out;
+}
+
+} // namespace paxoslease
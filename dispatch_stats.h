@@ -0,0 +1,167 @@
+#ifndef PAXOSLEASE_DISPATCH_STATS_H
+#define PAXOSLEASE_DISPATCH_STATS_H
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace paxoslease {
+
+/// Cheapest monotonic tick source: the TSC on x86, steady_clock elsewhere.
+/// Ticks are turned into nanoseconds only when a snapshot is taken.
+class CycleClock {
+public:
+    static uint64_t Now()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return SteadyNanos();
+#endif
+    }
+
+    /// Measured once, on first use.
+    static double NanosPerTick();
+
+    static uint64_t SteadyNanos();
+};
+
+/// Lock-free log-linear histogram (HDR style) of tick counts: values below
+/// kSubBuckets are exact, above that every power of two is split into
+/// kSubBuckets linear buckets, so any recorded value is known to within
+/// 1 / kSubBuckets (12.5%). The sum of the values is kept exactly, for the
+/// mean. Record() is two relaxed atomic adds, plus a CAS on the max when
+/// value is a new one.
+class LatencyHistogram {
+public:
+    static const int kSubBucketBits = 3;
+    static const int kSubBuckets = 1 << kSubBucketBits;
+    static const int kNumBuckets = (64 - kSubBucketBits + 1) * kSubBuckets;
+
+    LatencyHistogram();
+
+    void Record(uint64_t value)
+    {
+        buckets_[BucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+        sum_.fetch_add(value, std::memory_order_relaxed);
+        uint64_t max = max_.load(std::memory_order_relaxed);
+        while(value > max && ! max_.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+        }
+    }
+
+    /// Bucket counts, sum and max, not atomic as a whole: records made while
+    /// copying may or may not be included.
+    void Load(std::vector<uint64_t>* buckets, uint64_t* sum, uint64_t* max) const;
+
+    static int BucketOf(uint64_t value)
+    {
+        if(value < static_cast<uint64_t>(kSubBuckets)) {
+            return static_cast<int>(value);
+        }
+        const int msb = 63 - __builtin_clzll(value);
+        const int shift = msb - kSubBucketBits;
+        return (shift + 1) * kSubBuckets + static_cast<int>((value >> shift) & (kSubBuckets - 1));
+    }
+
+    /// Largest value falling into bucket.
+    static uint64_t BucketLimit(int bucket);
+
+private:
+    std::atomic<uint64_t> buckets_[kNumBuckets];
+    std::atomic<uint64_t> sum_;
+    std::atomic<uint64_t> max_;
+
+    LatencyHistogram(const LatencyHistogram&);
+    LatencyHistogram& operator =(const LatencyHistogram&);
+};
+
+/// What DispatchStats::Snapshot() reports for one message type.
+struct DispatchTypeStats {
+    std::string type_name;
+    uint64_t count;         // messages dispatched
+    uint64_t bytes;         // wire bytes, for messages whose size was passed in
+    uint64_t samples;       // handler calls timed
+    double mean_ns;
+    double p50_ns;
+    double p90_ns;
+    double p99_ns;
+    double p999_ns;
+    double max_ns;
+};
+
+/// Per message type dispatch counters and handler latency, for
+/// ProtobufDispatcher::SetStats(). All updates are relaxed atomics, so one
+/// DispatchStats can be shared by dispatchers running on several threads.
+///
+/// Every message is counted, but only one handler call in sample_every
+/// (rounded up to a power of two) is timed: a TSC read costs 10-25 ns, far
+/// more than the counters, so timing every call would not do for a stat
+/// that stays on in production. Pass 1 to time them all.
+class DispatchStats {
+public:
+    static const uint32_t kDefaultSampleEvery = 64;
+
+    explicit DispatchStats(uint32_t sample_every = kDefaultSampleEvery);
+    ~DispatchStats();
+
+    /// Count a message of type_id (a MessageRegistry id, or kInvalidTypeId
+    /// for messages outside message.proto). Returns the start tick if the
+    /// handler call is to be timed, else 0.
+    uint64_t Begin(int type_id, int bytes)
+    {
+        const uint64_t count = Count(type_id, bytes);
+        return (count & sample_mask_) == 0 ? CycleClock::Now() : 0;
+    }
+
+    /// Count a message without timing it. Returns the previous count.
+    uint64_t Count(int type_id, int bytes)
+    {
+        TypeStats& stats = StatsOf(type_id);
+        if(bytes > 0) {
+            stats.bytes.fetch_add(bytes, std::memory_order_relaxed);
+        }
+        return stats.count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void End(int type_id, uint64_t start)
+    {
+        const uint64_t now = CycleClock::Now();
+        StatsOf(type_id).latency.Record(now > start ? now - start : 0);
+    }
+
+    /// Types never dispatched are left out.
+    void Snapshot(std::vector<DispatchTypeStats>* types) const;
+
+    /// Snapshot() as one line of JSON per type.
+    std::string ToString() const;
+
+private:
+    struct TypeStats {
+        TypeStats() : count(0), bytes(0) {}
+
+        std::atomic<uint64_t> count;
+        std::atomic<uint64_t> bytes;
+        LatencyHistogram latency;
+    };
+
+    TypeStats& StatsOf(int type_id)
+    {
+        return *types_[static_cast<size_t>(type_id) < types_.size() ? type_id : 0];
+    }
+
+    uint64_t sample_mask_;
+    std::vector<std::unique_ptr<TypeStats> > types_; // by type id, 0 for the others
+
+    DispatchStats(const DispatchStats&);
+    DispatchStats& operator =(const DispatchStats&);
+};
+
+} // namespace paxoslease
+
+#endif //PAXOSLEASE_DISPATCH_STATS_H
@@ -1,11 +1,19 @@
 #ifndef PAXOSLEASE_DISPATHER_H
 #define PAXOSLEASE_DISPATHER_H
 
+#include <assert.h>
+#include <stdint.h>
+#include <algorithm>
+#include <deque>
 #include <map>
 #include <memory>
 #include <functional>
+#include <vector>
 
+#include "dispatch_stats.h"
 #include "message.pb.h"
+#include "message_pool.h"
+#include "message_registry.h"
 
 
 namespace paxoslease {
@@ -31,38 +39,415 @@ public:
 
     virtual void OnMessage(google::protobuf::Message* message) const
     {
-        T* t = dynamic_cast<T*>(message);
-        assert(t != 0);
-        callback_(t);
+        // looked up by descriptor, so message is always a T.
+        assert(dynamic_cast<T*>(message) != 0);
+        Call(static_cast<T*>(message));
+    }
+
+    void Call(T* message) const
+    {
+        callback_(message);
     }
 
 private:
     ProtobufMessageCallback callback_;
 };
 
+class BatchCallback {
+public:
+    virtual ~BatchCallback() {};
+    virtual void Add(google::protobuf::Message* message) = 0;
+    virtual bool IsEmpty() const = 0;
+    virtual void Flush() = 0;
+};
+
+/// Collects the messages of one type during a batch, then hands them all to
+/// the callback at once.
+template <typename T>
+class BatchCallbackObj: public BatchCallback
+{
+public:
+    typedef std::function<void(const std::vector<T*>& messages)> ProtobufBatchCallback;
+
+    BatchCallbackObj(const ProtobufBatchCallback& callback)
+        : callback_(callback)
+    {
+        assert(callback_ != 0);
+    }
+
+    virtual void Add(google::protobuf::Message* message)
+    {
+        // looked up by type id, so message is always a T.
+        assert(dynamic_cast<T*>(message) != 0);
+        batch_.push_back(static_cast<T*>(message));
+    }
+
+    virtual bool IsEmpty() const
+    {
+        return batch_.empty();
+    }
+
+    virtual void Flush()
+    {
+        if(!batch_.empty())
+        {
+            callback_(batch_);
+            batch_.clear(); // keeps the capacity for the next batch
+        }
+    }
+
+private:
+    ProtobufBatchCallback callback_;
+    std::vector<T*> batch_;
+};
+
+/// Messages of message.proto are dispatched through a flat table indexed by
+/// their MessageRegistry type id: one array load and one direct call, no map
+/// lookup, no virtual call and no dynamic_cast. Other messages fall back to
+/// a lookup by descriptor.
 class ProtobufDispatcher {
 public:
-    void OnMessage(google::protobuf::Message* message) const
+    /// Lanes of Post(), highest drained first. New types go to lane 0.
+    static const int kNumLanes = 4;
+
+    ProtobufDispatcher()
+        : registry_(MessageRegistry::Instance()),
+          stats_(NULL),
+          starvation_limit_(4),
+          starvation_quota_(16)
     {
-        CallbackMap::const_iterator it = callbacks_.find(message->GetDescriptor());
-        if(it != callbacks_.end())
+        for(int lane = 0; lane < kNumLanes; lane++)
         {
-            it->second->OnMessage(message);
+            skipped_[lane] = 0;
         }
     }
 
+    /// Record per type counts and handler latency into stats, which must
+    /// outlive the dispatcher. NULL, the default, turns recording off.
+    void SetStats(DispatchStats* stats)
+    {
+        stats_ = stats;
+    }
+
+    DispatchStats* stats() const { return stats_; }
+
+    /// bytes is the wire size of message, if known, for the stats.
+    void OnMessage(google::protobuf::Message* message, int bytes = 0) const
+    {
+        const google::protobuf::Descriptor* descriptor = message->GetDescriptor();
+        const size_t type_id = registry_.TypeId(descriptor);
+        if(stats_)
+        {
+            const uint64_t start = stats_->Begin(type_id, bytes);
+            Route(descriptor, type_id, message);
+            if(start)
+            {
+                stats_->End(type_id, start);
+            }
+            return;
+        }
+        Route(descriptor, type_id, message);
+    }
+
+    /// Dispatch all messages decoded in one read cycle. Each type with a
+    /// batch callback gets a single call with all its messages, in arrival
+    /// order, after the pass over messages; every other message goes
+    /// through OnMessage() during the pass, in arrival order.
+    ///
+    /// Note: batches are collected inside the dispatcher, so OnMessages()
+    /// must not be called concurrently or from a callback.
+    void OnMessages(google::protobuf::Message* const* messages, size_t count) const
+    {
+        for(size_t i = 0; i < count; i++)
+        {
+            Collect(messages[i]);
+        }
+        FlushBatches();
+    }
+
+    void OnMessages(const std::vector<google::protobuf::Message*>& messages) const
+    {
+        OnMessages(messages.empty() ? NULL : &messages[0], messages.size());
+    }
+
+    void OnMessages(const std::vector<MessagePtr>& messages) const
+    {
+        for(size_t i = 0; i < messages.size(); i++)
+        {
+            Collect(messages[i].get());
+        }
+        FlushBatches();
+    }
+
+    /// Register a callback receiving every message of type T of a batch at
+    /// once, see OnMessages(). Only messages of message.proto can be
+    /// batched, and single messages passed to OnMessage() still go to the
+    /// callback registered with RegisterMessageCallback().
+    template <typename T>
+    bool RegisterBatchCallback(const typename BatchCallbackObj<T>::ProtobufBatchCallback& callback)
+    {
+        const size_t type_id = registry_.TypeId(T::descriptor());
+        if(type_id == MessageRegistry::kInvalidTypeId)
+        {
+            return false;
+        }
+        if(batches_.size() <= type_id)
+        {
+            batches_.resize(registry_.size());
+        }
+        batches_[type_id].reset(new BatchCallbackObj<T>(callback));
+        return true;
+    }
+
     template <typename T>
     void RegisterMessageCallback(const typename CallbackObj<T>::ProtobufMessageCallback& callback)
     {
         std::shared_ptr<CallbackObj<T> > sp(new CallbackObj<T>(callback));
         callbacks_[T::descriptor()] = sp;
+
+        const size_t type_id = registry_.TypeId(T::descriptor());
+        if(type_id != MessageRegistry::kInvalidTypeId)
+        {
+            if(slots_.size() <= type_id)
+            {
+                slots_.resize(registry_.size());
+            }
+            slots_[type_id].invoke = &Invoke<T>;
+            slots_[type_id].callback = sp.get();
+        }
+    }
+
+    /// Send messages of type T posted with Post() to lane. Returns false if
+    /// T is not in message.proto or lane is out of range.
+    template <typename T>
+    bool SetLane(int lane)
+    {
+        const size_t type_id = registry_.TypeId(T::descriptor());
+        if(type_id == MessageRegistry::kInvalidTypeId || lane < 0 || lane >= kNumLanes)
+        {
+            return false;
+        }
+        if(lane_rules_.size() <= type_id)
+        {
+            lane_rules_.resize(registry_.size());
+        }
+        lane_rules_[type_id].lane = lane;
+        return true;
+    }
+
+    /// Send the messages of type T matching predicate to lane instead, e.g.
+    /// renewals of a lease already held. Predicates are tried in the order
+    /// they were added, the first match wins.
+    template <typename T>
+    bool SetLane(int lane, const std::function<bool(const T& message)>& predicate)
+    {
+        const size_t type_id = registry_.TypeId(T::descriptor());
+        if(type_id == MessageRegistry::kInvalidTypeId || lane < 0 || lane >= kNumLanes || !predicate)
+        {
+            return false;
+        }
+        if(lane_rules_.size() <= type_id)
+        {
+            lane_rules_.resize(registry_.size());
+        }
+        LaneRule::Predicate rule = [predicate](const google::protobuf::Message& message) {
+            return predicate(static_cast<const T&>(message));
+        };
+        lane_rules_[type_id].predicates.push_back(std::make_pair(lane, rule));
+        return true;
+    }
+
+    /// A lane passed over by max_skipped Drain() calls in a row while it had
+    /// messages is served first in the next one, up to quota messages, so
+    /// busy higher lanes delay lower ones but never starve them.
+    void SetStarvationLimit(int max_skipped, size_t quota)
+    {
+        starvation_limit_ = max_skipped;
+        starvation_quota_ = quota;
+    }
+
+    int LaneOf(const google::protobuf::Message& message) const
+    {
+        const size_t type_id = registry_.TypeId(message.GetDescriptor());
+        if(type_id >= lane_rules_.size())
+        {
+            return 0;
+        }
+        const LaneRule& rule = lane_rules_[type_id];
+        for(size_t i = 0; i < rule.predicates.size(); i++)
+        {
+            if(rule.predicates[i].second(message))
+            {
+                return rule.predicates[i].first;
+            }
+        }
+        return rule.lane;
+    }
+
+    /// Queue message on its lane, to be dispatched by Drain(). Messages left
+    /// queued are released when the dispatcher goes, so their pool must
+    /// outlive it.
+    void Post(MessagePtr message)
+    {
+        if(message)
+        {
+            const int lane = LaneOf(*message);
+            lanes_[lane].push_back(std::move(message));
+        }
+    }
+
+    /// Dispatch up to max_messages posted messages, once per loop iteration:
+    /// starved lanes get their quota first, then lanes are drained from the
+    /// highest down, each in post order. Returns the # dispatched.
+    ///
+    /// Note: messages posted by callbacks during Drain() count against
+    /// max_messages and may be dispatched in the same call.
+    size_t Drain(size_t max_messages = SIZE_MAX)
+    {
+        size_t served[kNumLanes] = { 0 };
+        size_t ndispatched = 0;
+        for(int lane = kNumLanes - 1; lane >= 0; lane--)
+        {
+            if(skipped_[lane] >= starvation_limit_)
+            {
+                served[lane] = DrainLane(lane, std::min(starvation_quota_, max_messages - ndispatched));
+                ndispatched += served[lane];
+            }
+        }
+        for(int lane = kNumLanes - 1; lane >= 0 && ndispatched < max_messages; lane--)
+        {
+            const size_t nserved = DrainLane(lane, max_messages - ndispatched);
+            served[lane] += nserved;
+            ndispatched += nserved;
+        }
+        for(int lane = 0; lane < kNumLanes; lane++)
+        {
+            skipped_[lane] = (!lanes_[lane].empty() && served[lane] == 0) ? skipped_[lane] + 1 : 0;
+        }
+        return ndispatched;
+    }
+
+    size_t Pending(int lane) const { return lanes_[lane].size(); }
+
+    size_t Pending() const
+    {
+        size_t npending = 0;
+        for(int lane = 0; lane < kNumLanes; lane++)
+        {
+            npending += lanes_[lane].size();
+        }
+        return npending;
     }
 
-    
 private:
     typedef std::map<const google::protobuf::Descriptor*, std::shared_ptr<Callback> > CallbackMap;
-    
+
+    struct LaneRule {
+        typedef std::function<bool(const google::protobuf::Message& message)> Predicate;
+
+        LaneRule() : lane(0) {}
+
+        int lane;
+        std::vector<std::pair<int, Predicate> > predicates;
+    };
+
+    struct Slot {
+        Slot() : invoke(0), callback(0) {}
+
+        void (*invoke)(const Callback* callback, google::protobuf::Message* message);
+        const Callback* callback; // owned by callbacks_
+    };
+
+    // the slot is picked by the type id of message, so it is always a T.
+    template <typename T>
+    static void Invoke(const Callback* callback, google::protobuf::Message* message)
+    {
+        static_cast<const CallbackObj<T>*>(callback)->Call(static_cast<T*>(message));
+    }
+
+    void Route(const google::protobuf::Descriptor* descriptor, size_t type_id,
+            google::protobuf::Message* message) const
+    {
+        if(type_id != MessageRegistry::kInvalidTypeId)
+        {
+            if(type_id < slots_.size() && slots_[type_id].invoke)
+            {
+                const Slot& slot = slots_[type_id];
+                slot.invoke(slot.callback, message);
+            }
+            return;
+        }
+
+        CallbackMap::const_iterator it = callbacks_.find(descriptor);
+        if(it != callbacks_.end())
+        {
+            it->second->OnMessage(message);
+        }
+    }
+
+    // add message to the batch of its type, or dispatch it right away.
+    void Collect(google::protobuf::Message* message) const
+    {
+        const size_t type_id = registry_.TypeId(message->GetDescriptor());
+        if(type_id < batches_.size() && batches_[type_id])
+        {
+            if(stats_)
+            {
+                stats_->Count(type_id, 0);
+            }
+            batches_[type_id]->Add(message);
+        }
+        else
+        {
+            OnMessage(message);
+        }
+    }
+
+    size_t DrainLane(int lane, size_t max_messages)
+    {
+        std::deque<MessagePtr>& queue = lanes_[lane];
+        size_t ndispatched = 0;
+        while(ndispatched < max_messages && !queue.empty())
+        {
+            // off the queue first: the callback may post more.
+            MessagePtr message(std::move(queue.front()));
+            queue.pop_front();
+            OnMessage(message.get());
+            ndispatched++;
+        }
+        return ndispatched;
+    }
+
+    void FlushBatches() const
+    {
+        for(size_t type_id = 0; type_id < batches_.size(); type_id++)
+        {
+            // types with nothing this batch are skipped: they would record
+            // an empty call as a sample.
+            if(batches_[type_id] && !batches_[type_id]->IsEmpty())
+            {
+                // a batch callback is timed as a whole, once per batch.
+                const uint64_t start = stats_ ? CycleClock::Now() : 0;
+                batches_[type_id]->Flush();
+                if(start)
+                {
+                    stats_->End(type_id, start);
+                }
+            }
+        }
+    }
+
+    const MessageRegistry& registry_;
+    std::vector<Slot> slots_;
     CallbackMap callbacks_;
+    std::vector<std::shared_ptr<BatchCallback> > batches_; // by type id
+    DispatchStats* stats_;
+
+    std::vector<LaneRule> lane_rules_; // by type id
+    std::deque<MessagePtr> lanes_[kNumLanes];
+    int skipped_[kNumLanes];
+    int starvation_limit_;
+    size_t starvation_quota_;
 };
 
 } // namespace
@@ -0,0 +1,160 @@
+#ifndef PAXOSLEASE_FIXED_LAYOUT_H
+#define PAXOSLEASE_FIXED_LAYOUT_H
+
+#include <arpa/inet.h> //htonl, ntohl
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#include "message.pb.h"
+#include "message_registry.h"
+
+namespace paxoslease {
+
+/// Fixed wire layout of a message, used by kFrameFixed frames in place of
+/// the protobuf encoding: every field at a fixed offset, int32 big endian,
+/// bool as one byte. Encoding and decoding go through the generated
+/// accessors only, no reflection.
+///
+/// Only the messages that specialize FixedLayout can be sent as fixed
+/// frames. A specialization provides:
+///
+///   static const int kSize;                      // bytes on the wire
+///   static void Write(const T& message, char* buf);
+///   static void Read(const char* buf, T* message);
+template <typename T>
+struct FixedLayout;
+
+inline void PutFixedInt32(char* buf, int32_t value)
+{
+    const uint32_t be32 = ::htonl(static_cast<uint32_t>(value));
+    ::memcpy(buf, &be32, sizeof(be32));
+}
+
+inline int32_t GetFixedInt32(const char* buf)
+{
+    uint32_t be32 = 0;
+    ::memcpy(&be32, buf, sizeof(be32));
+    return static_cast<int32_t>(::ntohl(be32));
+}
+
+/// node_id | ballot_number
+template <typename T>
+struct NodeBallotLayout {
+    static const int kSize = 2 * sizeof(int32_t);
+
+    static void Write(const T& message, char* buf)
+    {
+        PutFixedInt32(buf, message.node_id());
+        PutFixedInt32(buf + sizeof(int32_t), message.ballot_number());
+    }
+
+    static void Read(const char* buf, T* message)
+    {
+        message->set_node_id(GetFixedInt32(buf));
+        message->set_ballot_number(GetFixedInt32(buf + sizeof(int32_t)));
+    }
+};
+
+template <>
+struct FixedLayout<PrepareRequest> : public NodeBallotLayout<PrepareRequest> {};
+
+template <>
+struct FixedLayout<ProposeRequest> : public NodeBallotLayout<ProposeRequest> {};
+
+template <>
+struct FixedLayout<ProposeResponse> : public NodeBallotLayout<ProposeResponse> {};
+
+/// node_id | ballot_number | lease_empty
+template <>
+struct FixedLayout<PrepareResponse> {
+    static const int kSize = 2 * sizeof(int32_t) + 1;
+
+    static void Write(const PrepareResponse& message, char* buf)
+    {
+        NodeBallotLayout<PrepareResponse>::Write(message, buf);
+        buf[2 * sizeof(int32_t)] = message.lease_empty() ? 1 : 0;
+    }
+
+    static void Read(const char* buf, PrepareResponse* message)
+    {
+        NodeBallotLayout<PrepareResponse>::Read(buf, message);
+        message->set_lease_empty(buf[2 * sizeof(int32_t)] != 0);
+    }
+};
+
+/// Largest FixedLayout<T>::kSize, for stack buffers. Checked when the
+/// layout is registered with FixedLayoutTable.
+const int kMaxFixedLayoutSize = 16;
+
+/// Type erased FixedLayout, for the generic codec path.
+struct FixedLayoutEntry {
+    int size;
+    void (*write)(const google::protobuf::Message& message, char* buf);
+    void (*read)(const char* buf, google::protobuf::Message* message);
+};
+
+/// FixedLayout entries indexed by MessageRegistry type id.
+class FixedLayoutTable {
+public:
+    static const FixedLayoutTable& Instance()
+    {
+        static const FixedLayoutTable table;
+        return table;
+    }
+
+    /// NULL if the type has no fixed layout.
+    const FixedLayoutEntry* Find(int type_id) const
+    {
+        if(type_id <= MessageRegistry::kInvalidTypeId || type_id >= static_cast<int>(entries_.size()) ||
+                entries_[type_id].size <= 0)
+        {
+            return NULL;
+        }
+        return &entries_[type_id];
+    }
+
+private:
+    FixedLayoutTable()
+        : entries_(MessageRegistry::Instance().size())
+    {
+        Register<PrepareRequest>();
+        Register<PrepareResponse>();
+        Register<ProposeRequest>();
+        Register<ProposeResponse>();
+    }
+
+    // The type id is taken from the descriptor of the message, so the
+    // static_casts below always see the type they expect.
+    template <typename T>
+    static void WriteMessage(const google::protobuf::Message& message, char* buf)
+    {
+        FixedLayout<T>::Write(static_cast<const T&>(message), buf);
+    }
+
+    template <typename T>
+    static void ReadMessage(const char* buf, google::protobuf::Message* message)
+    {
+        FixedLayout<T>::Read(buf, static_cast<T*>(message));
+    }
+
+    template <typename T>
+    void Register()
+    {
+        // the codec encodes and decodes through stack buffers of this size.
+        static_assert(FixedLayout<T>::kSize <= kMaxFixedLayoutSize, "raise kMaxFixedLayoutSize");
+        FixedLayoutEntry& entry = entries_[MessageRegistry::Instance().TypeId(T::descriptor())];
+        entry.size = FixedLayout<T>::kSize;
+        entry.write = &WriteMessage<T>;
+        entry.read = &ReadMessage<T>;
+    }
+
+    std::vector<FixedLayoutEntry> entries_;
+
+    FixedLayoutTable(const FixedLayoutTable&);
+    FixedLayoutTable& operator =(const FixedLayoutTable&);
+};
+
+} // namespace paxoslease
+
+#endif //PAXOSLEASE_FIXED_LAYOUT_H
@@ -0,0 +1,92 @@
+#include "frame_decoder.h"
+
+#include <assert.h>
+#include <algorithm>
+#include <utility>
+
+#include "io_buffer_stream.h"
+
+namespace paxoslease {
+
+FrameDecoder::FrameDecoder(MessagePool* pool, int max_frame_length)
+    : pool_(pool),
+      max_frame_length_(std::min(max_frame_length, kHeadLengthSpace + kMaxHeadLength)),
+      buffer_(),
+      format_(kFrameTypeName),
+      head_length_(-1),
+      frames_dropped_(0),
+      corrupt_(false)
+{
+}
+
+FrameDecoder::~FrameDecoder()
+{
+}
+
+void FrameDecoder::Reset()
+{
+    buffer_.Clear();
+    format_ = kFrameTypeName;
+    head_length_ = -1;
+    corrupt_ = false;
+}
+
+int FrameDecoder::Decode(IOBuffer* input, std::vector<MessagePtr>* messages)
+{
+    if(corrupt_ || ! messages) {
+        return -1;
+    }
+    if(input) {
+        buffer_.Move(input);
+    }
+
+    const int length = buffer_.BytesConsumable();
+    int consumed = 0;
+    int ndecoded = 0;
+    {
+        IOBufferInputStream stream(&buffer_);
+        google::protobuf::io::CodedInputStream coded_input(&stream);
+
+        while(true) {
+            if(head_length_ < 0) {
+                int32_t head_length = 0;
+                if(length - consumed < kHeadLengthSpace) {
+                    break;
+                }
+                if(! DecodeHeadWord(&coded_input, &format_, &head_length) ||
+                        head_length > max_frame_length_ - kHeadLengthSpace) {
+                    corrupt_ = true;
+                    break;
+                }
+                head_length_ = head_length;
+                consumed += kHeadLengthSpace;
+            }
+            if(length - consumed < head_length_) {
+                break;
+            }
+
+            MessagePtr message = DecodeFrameBody(&coded_input, format_, head_length_, pool_);
+            if(message) {
+                messages->push_back(std::move(message));
+                ndecoded++;
+            } else {
+                frames_dropped_++;
+            }
+
+            // resync on the frame boundary whatever the body parser left behind.
+            consumed += head_length_;
+            const int skip = consumed - coded_input.CurrentPosition();
+            assert(skip >= 0);
+            if(skip > 0 && ! coded_input.Skip(skip)) {
+                corrupt_ = true;
+                break;
+            }
+            head_length_ = -1;
+        }
+    }
+    buffer_.Consume(consumed);
+
+    return corrupt_ ? -1 : ndecoded;
+}
+
+} // namespace paxoslease
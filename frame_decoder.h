@@ -0,0 +1,60 @@
+#ifndef PAXOSLEASE_FRAME_DECODER_H
+#define PAXOSLEASE_FRAME_DECODER_H
+
+#include <vector>
+
+#include "codec.h"
+#include "io_buffer.h"
+#include "message_pool.h"
+
+namespace paxoslease {
+
+/// Incremental decoder for a stream of frames, e.g. a TCP connection or a
+/// series of batched reads. Bytes are moved (not copied) out of the input
+/// IOBuffer as they arrive, every complete frame is decoded in one pass, and
+/// a partial frame is kept, together with its already parsed head word,
+/// until the rest of it arrives.
+///
+/// A frame that fails to parse (unknown type, bad payload) is dropped and
+/// decoding goes on with the next one, since its length is still known. A
+/// head word with an unknown format or a length above max_frame_length
+/// means the stream can no longer be framed; Decode() then fails until
+/// Reset() is called.
+class FrameDecoder {
+public:
+    explicit FrameDecoder(MessagePool* pool = 0,
+            int max_frame_length = kHeadLengthSpace + kMaxHeadLength);
+    ~FrameDecoder();
+
+    /// Take all bytes of input and append every message completed by them
+    /// to messages. Returns the # of messages appended, or -1 if the stream
+    /// is corrupt.
+    int Decode(IOBuffer* input, std::vector<MessagePtr>* messages);
+
+    /// Drop any buffered bytes and clear the error state.
+    void Reset();
+
+    /// # of bytes of the partial frame waiting for more input.
+    int BytesBuffered() const { return buffer_.BytesConsumable(); }
+
+    int frames_dropped() const { return frames_dropped_; }
+
+    bool IsCorrupt() const { return corrupt_; }
+
+private:
+    MessagePool* pool_;
+    const int max_frame_length_;
+
+    IOBuffer buffer_;
+    int format_;
+    int head_length_; // of the frame at the front of buffer_, -1 if unknown yet.
+    int frames_dropped_;
+    bool corrupt_;
+
+    FrameDecoder(const FrameDecoder&);
+    FrameDecoder& operator =(const FrameDecoder&);
+};
+
+} // namespace paxoslease
+
+#endif //PAXOSLEASE_FRAME_DECODER_H
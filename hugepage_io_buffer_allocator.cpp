@@ -0,0 +1,121 @@
+#include "hugepage_io_buffer_allocator.h"
+
+#include <stdint.h>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/mman.h>
+
+namespace paxoslease {
+
+HugePageIOBufferAllocator::HugePageIOBufferAllocator(size_t region_size, size_t buffer_size)
+    : buffer_size_(buffer_size),
+      region_size_((region_size + kHugePageSize - 1) / kHugePageSize * kHugePageSize),
+      region_(0),
+      backing_(kBackingHeap),
+      num_blocks_(0),
+      free_head_(kNil),
+      next_(),
+      fallbacks_(0)
+{
+    if(buffer_size_ == 0 || region_size_ == 0) {
+        return;
+    }
+#ifdef MAP_HUGETLB
+    if(Map(MAP_HUGETLB)) {
+        backing_ = kBackingHugeTlb;
+    }
+#endif
+    if(! region_ && Map(0)) {
+        backing_ = kBackingTransparent;
+#ifdef MADV_HUGEPAGE
+        // only a hint: fine if THP is off.
+        ::madvise(region_, region_size_, MADV_HUGEPAGE);
+#endif
+    }
+    if(! region_) {
+        return;
+    }
+    Prefault();
+
+    const size_t num_blocks = std::min<size_t>(region_size_ / buffer_size_, kNil);
+    num_blocks_ = static_cast<uint32_t>(num_blocks);
+    next_.reset(new std::atomic<uint32_t>[num_blocks_]);
+    for(uint32_t i = 0; i < num_blocks_; i++) {
+        next_[i].store(i + 1 < num_blocks_ ? i + 1 : kNil, std::memory_order_relaxed);
+    }
+    free_head_.store(num_blocks_ > 0 ? 0 : kNil, std::memory_order_release);
+}
+
+HugePageIOBufferAllocator::~HugePageIOBufferAllocator()
+{
+    if(region_) {
+        ::munmap(region_, region_size_);
+    }
+}
+
+// hugetlb mappings come huge page aligned. A normal mapping need not be, and
+// THP only backs aligned 2MB ranges: over-map it by a huge page and trim the
+// slack off both ends.
+bool HugePageIOBufferAllocator::Map(int flags)
+{
+    const size_t slack = flags == 0 ? kHugePageSize : 0;
+    void* region = ::mmap(NULL, region_size_ + slack, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+    if(region == MAP_FAILED) {
+        return false;
+    }
+    char* start = static_cast<char*>(region);
+    if(slack > 0) {
+        char* aligned = reinterpret_cast<char*>(
+                (reinterpret_cast<uintptr_t>(start) + kHugePageSize - 1) & ~(kHugePageSize - 1));
+        const size_t head = aligned - start;
+        if(head > 0) {
+            ::munmap(start, head);
+        }
+        if(slack > head) {
+            ::munmap(aligned + region_size_, slack - head);
+        }
+        start = aligned;
+    }
+    region_ = start;
+    return true;
+}
+
+// fault every page in now rather than on the first receive into it.
+void HugePageIOBufferAllocator::Prefault()
+{
+    const size_t page_size = backing_ == kBackingHugeTlb ? kHugePageSize : ::sysconf(_SC_PAGESIZE);
+    for(size_t offset = 0; offset < region_size_; offset += page_size) {
+        region_[offset] = 0;
+    }
+}
+
+char* HugePageIOBufferAllocator::Allocate()
+{
+    uint64_t head = free_head_.load(std::memory_order_acquire);
+    while(static_cast<uint32_t>(head) != kNil) {
+        const uint32_t index = static_cast<uint32_t>(head);
+        const uint64_t next = ((head >> 32) + 1) << 32 | next_[index].load(std::memory_order_relaxed);
+        if(free_head_.compare_exchange_weak(head, next, std::memory_order_acquire)) {
+            return region_ + index * buffer_size_;
+        }
+    }
+    fallbacks_.fetch_add(1, std::memory_order_relaxed);
+    return new char[buffer_size_];
+}
+
+void HugePageIOBufferAllocator::Deallocate(char* buf)
+{
+    if(! Contains(buf)) {
+        delete [] buf;
+        return;
+    }
+    const uint32_t index = static_cast<uint32_t>((buf - region_) / buffer_size_);
+    uint64_t head = free_head_.load(std::memory_order_relaxed);
+    do {
+        next_[index].store(static_cast<uint32_t>(head), std::memory_order_relaxed);
+    } while(! free_head_.compare_exchange_weak(head,
+                ((head >> 32) + 1) << 32 | index, std::memory_order_release));
+}
+
+} // namespace paxoslease
@@ -0,0 +1,89 @@
+#ifndef PAXOSLEASE_HUGEPAGE_IO_BUFFER_ALLOCATOR_H
+#define PAXOSLEASE_HUGEPAGE_IO_BUFFER_ALLOCATOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+
+#include "io_buffer.h"
+
+namespace paxoslease {
+
+/// IOBufferAllocator carving every block out of one contiguous mmap region,
+/// backed by huge pages when the system has them, and faulted in up front
+/// so the network path never takes a page fault or a TLB miss per 4KB.
+///
+/// The region is mapped with MAP_HUGETLB first; if no huge pages are
+/// reserved, it falls back to normal pages with MADV_HUGEPAGE (transparent
+/// huge pages), and if mmap fails altogether every block comes from new.
+/// Once the region is used up, blocks come from new as well; they are told
+/// apart by address on Deallocate().
+///
+/// Free blocks are kept on a lock-free stack of block indices whose head
+/// carries a tag against ABA, so any thread may allocate and deallocate.
+class HugePageIOBufferAllocator : public IOBufferAllocator {
+public:
+    enum Backing {
+        kBackingHugeTlb,     // MAP_HUGETLB
+        kBackingTransparent, // normal pages, madvise(MADV_HUGEPAGE)
+        kBackingHeap         // no region, every block from new
+    };
+
+    static const size_t kHugePageSize = 2 << 20;
+
+    /// region_size is rounded up to a whole # of huge pages.
+    explicit HugePageIOBufferAllocator(size_t region_size, size_t buffer_size = 4 << 10);
+    virtual ~HugePageIOBufferAllocator();
+
+    virtual size_t GetBufferSize() const { return buffer_size_; }
+    virtual char*  Allocate();
+    virtual void   Deallocate(char* buf);
+
+    Backing backing() const { return backing_; }
+
+    /// The region, NULL with kBackingHeap, for registering it with the
+    /// kernel for zero-copy I/O.
+    char* region() const { return region_; }
+    size_t region_size() const { return region_size_; }
+
+    bool Contains(const char* buf) const
+    {
+        return buf >= region_ && buf < region_ + num_blocks_ * buffer_size_;
+    }
+
+    /// Index of a block of the region, -1 for blocks from new.
+    int BlockIndex(const char* buf) const
+    {
+        return Contains(buf) ? static_cast<int>((buf - region_) / buffer_size_) : -1;
+    }
+
+    uint32_t num_blocks() const { return num_blocks_; }
+
+    /// Blocks allocated with new because the region was used up.
+    uint64_t fallbacks() const { return fallbacks_.load(std::memory_order_relaxed); }
+
+private:
+    static const uint32_t kNil = 0xffffffff;
+
+    bool Map(int flags);
+    void Prefault();
+
+    const size_t buffer_size_;
+    size_t region_size_;
+    char* region_;
+    Backing backing_;
+    uint32_t num_blocks_;
+
+    // head of the free stack: tag in the high 32 bits, block index below.
+    std::atomic<uint64_t> free_head_;
+    std::unique_ptr<std::atomic<uint32_t>[]> next_; // by block index
+    std::atomic<uint64_t> fallbacks_;
+
+    HugePageIOBufferAllocator(const HugePageIOBufferAllocator&);
+    HugePageIOBufferAllocator& operator =(const HugePageIOBufferAllocator&);
+};
+
+} // namespace paxoslease
+
+#endif //PAXOSLEASE_HUGEPAGE_IO_BUFFER_ALLOCATOR_H
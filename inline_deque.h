@@ -0,0 +1,193 @@
+#ifndef PAXOSLEASE_INLINE_DEQUE_H
+#define PAXOSLEASE_INLINE_DEQUE_H
+
+#include <assert.h>
+#include <stddef.h>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace paxoslease {
+
+/// A ring buffer deque keeping its first N elements inside the object and
+/// moving to a heap ring, doubled as needed, only when it outgrows them.
+/// N must be a power of two. Pushing and popping at either end is O(1);
+/// elements are moved, not copied, when the ring grows.
+///
+/// Note: unlike std::list, growing invalidates references and iterators.
+template <typename T, size_t N>
+class InlineDeque {
+public:
+    template <typename Deque, typename Value>
+    class Iterator {
+    public:
+        Iterator() : deque_(0), index_(0) {}
+        Iterator(Deque* deque, size_t index) : deque_(deque), index_(index) {}
+
+        // iterator -> const_iterator
+        template <typename D, typename V>
+        Iterator(const Iterator<D, V>& other) : deque_(other.deque_), index_(other.index_) {}
+
+        Value& operator *() const { return (*deque_)[index_]; }
+        Value* operator ->() const { return &(*deque_)[index_]; }
+
+        Iterator& operator ++() { index_++; return *this; }
+        Iterator operator ++(int) { Iterator it(*this); index_++; return it; }
+        Iterator& operator --() { index_--; return *this; }
+
+        bool operator ==(const Iterator& other) const { return index_ == other.index_; }
+        bool operator !=(const Iterator& other) const { return index_ != other.index_; }
+
+        size_t index() const { return index_; }
+
+    private:
+        template <typename D, typename V> friend class Iterator;
+
+        Deque* deque_;
+        size_t index_;
+    };
+
+    typedef Iterator<InlineDeque, T> iterator;
+    typedef Iterator<const InlineDeque, const T> const_iterator;
+
+    InlineDeque()
+        : data_(Inline()),
+          mask_(N - 1),
+          head_(0),
+          size_(0)
+    {
+        static_assert(N > 0 && (N & (N - 1)) == 0, "N must be a power of two");
+    }
+
+    ~InlineDeque()
+    {
+        clear();
+        if(data_ != Inline()) {
+            ::operator delete(data_);
+        }
+    }
+
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    /// true while the elements live inside the object.
+    bool is_inline() const { return data_ == Inline(); }
+
+    T& operator [](size_t i) { return data_[(head_ + i) & mask_]; }
+    const T& operator [](size_t i) const { return data_[(head_ + i) & mask_]; }
+
+    T& front() { return (*this)[0]; }
+    const T& front() const { return (*this)[0]; }
+    T& back() { return (*this)[size_ - 1]; }
+    const T& back() const { return (*this)[size_ - 1]; }
+
+    iterator begin() { return iterator(this, 0); }
+    iterator end() { return iterator(this, size_); }
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const { return const_iterator(this, size_); }
+
+    void push_back(const T& value)
+    {
+        T copy(value);
+        push_back(std::move(copy));
+    }
+
+    void push_back(T&& value)
+    {
+        if(size_ > mask_) {
+            Grow();
+        }
+        new (&data_[(head_ + size_) & mask_]) T(std::move(value));
+        size_++;
+    }
+
+    void pop_front()
+    {
+        assert(size_ > 0);
+        front().~T();
+        head_ = (head_ + 1) & mask_;
+        size_--;
+    }
+
+    void pop_back()
+    {
+        assert(size_ > 0);
+        back().~T();
+        size_--;
+    }
+
+    /// Drop the elements from index size on.
+    void truncate(size_t size)
+    {
+        while(size_ > size) {
+            pop_back();
+        }
+    }
+
+    void clear()
+    {
+        truncate(0);
+        head_ = 0;
+    }
+
+    /// Move all the elements of other to the back of this one, leaving
+    /// other empty. Takes over other's heap ring when this one is empty.
+    void splice_back(InlineDeque* other)
+    {
+        if(empty() && ! other->is_inline()) {
+            clear();
+            if(! is_inline()) {
+                ::operator delete(data_);
+            }
+            data_ = other->data_;
+            mask_ = other->mask_;
+            head_ = other->head_;
+            size_ = other->size_;
+            other->data_ = other->Inline();
+            other->mask_ = N - 1;
+            other->head_ = 0;
+            other->size_ = 0;
+            return;
+        }
+        for(size_t i = 0; i < other->size_; i++) {
+            push_back(std::move((*other)[i]));
+        }
+        other->clear();
+    }
+
+private:
+    typedef typename std::aligned_storage<sizeof(T), std::alignment_of<T>::value>::type Storage;
+
+    T* Inline() { return reinterpret_cast<T*>(inline_); }
+    const T* Inline() const { return reinterpret_cast<const T*>(inline_); }
+
+    void Grow()
+    {
+        const size_t capacity = (mask_ + 1) * 2;
+        T* data = static_cast<T*>(::operator new(capacity * sizeof(T)));
+        for(size_t i = 0; i < size_; i++) {
+            T& value = (*this)[i];
+            new (&data[i]) T(std::move(value));
+            value.~T();
+        }
+        if(! is_inline()) {
+            ::operator delete(data_);
+        }
+        data_ = data;
+        mask_ = capacity - 1;
+        head_ = 0;
+    }
+
+    T* data_;
+    size_t mask_;
+    size_t head_;
+    size_t size_;
+    Storage inline_[N];
+
+    InlineDeque(const InlineDeque&);
+    InlineDeque& operator =(const InlineDeque&);
+};
+
+} // namespace paxoslease
+
+#endif //PAXOSLEASE_INLINE_DEQUE_H
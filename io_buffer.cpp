@@ -1,55 +1,161 @@
 #include "io_buffer.h"
 
 #include <algorithm>
+#include <limits>
+#include <mutex>
+#include <errno.h>
 #include <string.h>
 #include <limits.h>
 #include <sys/uio.h>
+#include <sys/socket.h>
 #include <unistd.h> 
 #include <assert.h>
 
 namespace paxoslease {
 
-int IOBufferData::default_buffer_size_ =  4 << 10;
+// header in front of the data of blocks allocated here, rounded up to
+// keep the data 16 byte aligned.
+static const int kBlockHeaderSize = (sizeof(IOBufferBlock) + 15) & ~15;
+
+int IOBufferData::default_buffer_size_ =  (4 << 10) - kBlockHeaderSize;
 
 static IOBufferAllocator*  s_io_buffer_allocator = 0;
 static bool s_used_io_buffer_allocator = false;
-
-
-struct IOBufferArrayDeallocator {
-    void operator ()(char* buf) { 
-        delete [] buf; 
-    }
-};
-
-struct IOBufferDeallocator {
-    void operator ()(char* buf) {
-        s_io_buffer_allocator->Deallocate(buf); 
-    }
-};
-
-class IOBufferDeallocatorCustom {
-public:
-    IOBufferDeallocatorCustom(IOBufferAllocator& allocator)
-        : allocator_(allocator_)
-    { }
-    void operator ()(char* buf) {
-        allocator_.Deallocate(buf);
-    }
-private:
-    IOBufferAllocator& allocator_;
-};
+static bool s_atomic_refcount = true;
+
+static std::atomic<int64_t> s_memory_usage(0);
+static std::atomic<int64_t> s_memory_low(0);
+static std::atomic<int64_t> s_memory_high(0);  // 0: no watermarks
+static IOBufferMemoryCallback s_memory_callback;
+static std::atomic<bool> s_memory_above(false);
+// guards the callback, the state last reported to it and whether a report
+// is under way.
+static std::mutex s_memory_mutex;
+static bool s_memory_reported_above = false;
+static bool s_memory_reporting = false;
 
 // if you want change the default allocator, call this function
 bool SetIOBufferAllocator(IOBufferAllocator* allocator)
 {
     if(s_used_io_buffer_allocator ||
-            (allocator && int(allocator->GetBufferSize()) <= 0)) {
+            (allocator && int(allocator->GetBufferSize()) <= kBlockHeaderSize)) {
         return false;
     }
     s_io_buffer_allocator = allocator;
     return true;
 }
 
+void SetIOBufferAtomicRefcount(bool atomic)
+{
+    s_atomic_refcount = atomic;
+}
+
+int64_t IOBufferMemoryUsage()
+{
+    return s_memory_usage.load(std::memory_order_relaxed);
+}
+
+void SetIOBufferMemoryWatermarks(int64_t low, int64_t high, const IOBufferMemoryCallback& callback)
+{
+    std::lock_guard<std::mutex> lock(s_memory_mutex);
+    s_memory_high.store(0, std::memory_order_relaxed);
+    s_memory_low.store(std::min(low, high), std::memory_order_relaxed);
+    s_memory_callback = callback;
+    s_memory_above.store(false, std::memory_order_relaxed);
+    s_memory_reported_above = false;
+    s_memory_high.store(callback ? std::max<int64_t>(0, high) : 0, std::memory_order_release);
+}
+
+bool IOBufferMemoryAboveHigh()
+{
+    return s_memory_above.load(std::memory_order_relaxed);
+}
+
+// Tell the callback the current state if it has not heard it yet. The
+// callback runs without the lock, as it may well free or allocate blocks
+// and come back here; so may other threads crossing the watermarks
+// meanwhile. Either way they leave the new state to the report under way,
+// which goes on until the callback has heard what is true by then.
+static void ReportMemoryWatermark()
+{
+    std::unique_lock<std::mutex> lock(s_memory_mutex);
+    if(s_memory_reporting) {
+        return;
+    }
+    s_memory_reporting = true;
+    for(;;) {
+        const bool above = s_memory_above.load(std::memory_order_acquire);
+        if(above == s_memory_reported_above || ! s_memory_callback) {
+            break;
+        }
+        s_memory_reported_above = above;
+        const IOBufferMemoryCallback callback(s_memory_callback);
+        lock.unlock();
+        callback(above, s_memory_usage.load(std::memory_order_relaxed));
+        lock.lock();
+    }
+    s_memory_reporting = false;
+}
+
+// Count bytes of blocks coming and going; one relaxed add when there are
+// no watermarks.
+static inline void AccountMemory(int64_t delta)
+{
+    const int64_t usage = s_memory_usage.fetch_add(delta, std::memory_order_relaxed) + delta;
+    const int64_t high = s_memory_high.load(std::memory_order_acquire);
+    if(high <= 0) {
+        return;
+    }
+    bool above = ! (delta > 0);
+    if(delta > 0 ? usage >= high : usage <= s_memory_low.load(std::memory_order_relaxed)) {
+        if(s_memory_above.compare_exchange_strong(above, delta > 0, std::memory_order_acq_rel)) {
+            ReportMemoryWatermark();
+        }
+    }
+}
+
+void IOBufferBlock::Free()
+{
+    AccountMemory(-int64_t(size));
+    switch(kind) {
+    case kArray:
+        delete [] reinterpret_cast<char*>(this);
+        break;
+    case kAllocator:
+        allocator->Deallocate(reinterpret_cast<char*>(this));
+        break;
+    case kExternalArray:
+        delete [] data;
+        delete this;
+        break;
+    case kExternalAllocator:
+        allocator->Deallocate(data);
+        delete this;
+        break;
+    }
+}
+
+// Set up the header of a block. memory is where it goes, NULL for a
+// separate one; data is NULL for data following the header.
+static IOBufferBlock* NewBlock(char* memory, IOBufferBlock::Kind kind, IOBufferAllocator* allocator,
+        char* data, int size)
+{
+    IOBufferBlock* const block = memory ? reinterpret_cast<IOBufferBlock*>(memory) : new IOBufferBlock;
+    block->refs.store(1, std::memory_order_relaxed);
+    block->kind = kind;
+    block->atomic = s_atomic_refcount;
+    block->size = size;
+    block->allocator = allocator;
+    block->data = data ? data : memory + kBlockHeaderSize;
+    AccountMemory(size);
+    return block;
+}
+
+int IOBufferData::block_header_size()
+{
+    return kBlockHeaderSize;
+}
+
 inline int IOBufferData::MaxAvailable(int num_bytes) const
 {
     return std::max(0, std::min(int(SpaceAvailable()), num_bytes));
@@ -63,37 +169,42 @@ inline int IOBufferData::MaxConsumable(int num_bytes) const
 inline void IOBufferData::Init(char* buf, int buf_size)
 {
     const int size = std::max(0, buf_size);
-    data_share_ptr_.reset(buf ? buf : new char[size], IOBufferArrayDeallocator());
-    producer_ = data_share_ptr_.get();
-    end_= producer_ + size;
+    if(buf) {
+        block_ = NewBlock(0, IOBufferBlock::kExternalArray, 0, buf, size);
+    } else {
+        block_ = NewBlock(new char[kBlockHeaderSize + size], IOBufferBlock::kArray, 0, 0, size);
+    }
+    producer_ = 0;
+    end_= size;
     consumer_ = producer_;
 }
 
 
 inline void IOBufferData::Init(char* buf, IOBufferAllocator& allocator)
 {
-    if(&allocator == s_io_buffer_allocator) {
-        if(!s_used_io_buffer_allocator) {
-            default_buffer_size_ = s_io_buffer_allocator->GetBufferSize();
-        }
+    if(&allocator == s_io_buffer_allocator && !s_used_io_buffer_allocator) {
+        default_buffer_size_ = s_io_buffer_allocator->GetBufferSize() - kBlockHeaderSize;
         s_used_io_buffer_allocator = true;
-        data_share_ptr_.reset(buf ? buf : allocator.Allocate(),
-                IOBufferDeallocator());
-    } else {
-        data_share_ptr_.reset(buf ? buf : allocator.Allocate(),
-                IOBufferDeallocatorCustom(allocator));
     }
 
-    if(! (producer_ = data_share_ptr_.get())) {
-        abort();
+    const int buf_size = allocator.GetBufferSize();
+    if(buf) {
+        block_ = NewBlock(0, IOBufferBlock::kExternalAllocator, &allocator, buf, buf_size);
+    } else {
+        char* const memory = allocator.Allocate();
+        if(! memory) {
+            abort();
+        }
+        block_ = NewBlock(memory, IOBufferBlock::kAllocator, &allocator, 0, buf_size - kBlockHeaderSize);
     }
 
-    end_ = producer_ + allocator.GetBufferSize();
+    producer_ = 0;
+    end_ = block_->size;
     consumer_ = producer_;
 }
 
 IOBufferData::IOBufferData()
-    : data_share_ptr_(),
+    : block_(0),
       end_(0),
       producer_(0),
       consumer_(0)
@@ -106,7 +217,7 @@ IOBufferData::IOBufferData()
 }
 
 IOBufferData::IOBufferData(int buf_size)
-    : data_share_ptr_(),
+    : block_(0),
       end_(0),
       producer_(0),
       consumer_(0)
@@ -115,7 +226,7 @@ IOBufferData::IOBufferData(int buf_size)
 } 
 
 IOBufferData::IOBufferData(char* buf, int offset, int size, IOBufferAllocator& allocator)
-    : data_share_ptr_(),
+    : block_(0),
       end_(0),
       producer_(0),
       consumer_(0)
@@ -125,8 +236,20 @@ IOBufferData::IOBufferData(char* buf, int offset, int size, IOBufferAllocator& a
     IOBufferData::Consume(offset);
 }
 
+IOBufferData::IOBufferData(IOBufferAllocator& allocator, char* block, int size)
+    : block_(0),
+      end_(0),
+      producer_(0),
+      consumer_(0)
+{
+    block_ = NewBlock(block, IOBufferBlock::kAllocator, &allocator, 0,
+            allocator.GetBufferSize() - kBlockHeaderSize);
+    end_ = block_->size;
+    IOBufferData::Fill(size);
+}
+
 IOBufferData::IOBufferData(char* buf, int buf_size, int offset, int size)
-    : data_share_ptr_(),
+    : block_(0),
       end_(0),
       producer_(0),
       consumer_(0)
@@ -137,19 +260,71 @@ IOBufferData::IOBufferData(char* buf, int buf_size, int offset, int size)
 }
 
 IOBufferData::IOBufferData(const IOBufferData &other, char*s, char* e, char* p /* = 0*/)
-    : data_share_ptr_(other.data_share_ptr_),
-      end_(e),
-      producer_(p ? p : e),
-      consumer_(s)
+    : block_(other.block_),
+      end_(e - other.block_->data),
+      producer_((p ? p : e) - other.block_->data),
+      consumer_(s - other.block_->data)
 {
-    assert(data_share_ptr_.get() <= consumer_ && 
+    assert(other.block_->data <= s && 
             consumer_ <= producer_ && 
             producer_ <= end_ &&
             end_ <= other.end_);
+    block_->Ref();
+}
+
+IOBufferData::IOBufferData(const IOBufferData& other)
+    : block_(other.block_),
+      end_(other.end_),
+      producer_(other.producer_),
+      consumer_(other.consumer_)
+{
+    block_->Ref();
+}
+
+IOBufferData::IOBufferData(IOBufferData&& other)
+    : block_(other.block_),
+      end_(other.end_),
+      producer_(other.producer_),
+      consumer_(other.consumer_)
+{
+    other.block_ = 0;
+}
+
+IOBufferData& IOBufferData::operator =(const IOBufferData& other)
+{
+    if(this != &other) {
+        other.block_->Ref();
+        if(block_) {
+            block_->Unref();
+        }
+        block_ = other.block_;
+        end_ = other.end_;
+        producer_ = other.producer_;
+        consumer_ = other.consumer_;
+    }
+    return *this;
+}
+
+IOBufferData& IOBufferData::operator =(IOBufferData&& other)
+{
+    if(this != &other) {
+        if(block_) {
+            block_->Unref();
+        }
+        block_ = other.block_;
+        end_ = other.end_;
+        producer_ = other.producer_;
+        consumer_ = other.consumer_;
+        other.block_ = 0;
+    }
+    return *this;
 }
 
 IOBufferData::~IOBufferData()
 {
+    if(block_) {
+        block_->Unref();
+    }
 }
 
 int IOBufferData::Fill(int num_bytes)
@@ -163,7 +338,7 @@ int IOBufferData::Fill(int num_bytes)
 int IOBufferData::ZeroFill(int num_bytes)
 {
     const int nbytes = MaxAvailable(num_bytes);
-    memset(producer_, '\0', nbytes);
+    memset(Producer(), '\0', nbytes);
     producer_ += nbytes;
     
     return nbytes;
@@ -182,6 +357,11 @@ int IOBufferData::Trim(int num_bytes)
 {
     const int nbytes = MaxConsumable(num_bytes); 
     producer_ = consumer_ + nbytes;
+    if(IsShared()) {
+        // the trimmed bytes may still be visible through another
+        // IOBufferData: never write over them.
+        end_ = producer_;
+    }
     return nbytes;
 }
 
@@ -190,7 +370,7 @@ int IOBufferData::Read(int fd, int max_read_ahead)
     const int nbytes = MaxAvailable(max_read_ahead);
 
     if(nbytes > 0) {
-        int nread = read(fd, producer_, nbytes);
+        int nread = read(fd, Producer(), nbytes);
         if(nread > 0) {
             producer_ += nread;
         }
@@ -204,7 +384,7 @@ int IOBufferData::Write(int fd)
 {
     const int nbytes = BytesConsumable();
     if(nbytes > 0) {
-        int nwrote = write(fd, consumer_, nbytes);
+        int nwrote = write(fd, Consumer(), nbytes);
         if(nwrote > 0) {
             consumer_ += nwrote;
         }
@@ -217,7 +397,7 @@ int IOBufferData::Write(int fd)
 int IOBufferData::CopyIn(const char* buf, int num_bytes)
 {
     const int ncopy = MaxAvailable(num_bytes);
-    memmove(producer_, buf, ncopy); 
+    memmove(Producer(), buf, ncopy); 
     producer_ += ncopy;
     return ncopy;
 }
@@ -225,7 +405,7 @@ int IOBufferData::CopyIn(const char* buf, int num_bytes)
 int IOBufferData::Copy(const IOBufferData* other, int num_bytes)
 {
     const int ncopy = MaxAvailable(num_bytes);
-    memmove(producer_, other->Consumer(), ncopy);
+    memmove(Producer(), other->Consumer(), ncopy);
     producer_ += ncopy;
     return ncopy;
 }
@@ -233,19 +413,78 @@ int IOBufferData::Copy(const IOBufferData* other, int num_bytes)
 int IOBufferData::CopyOut(char* buf, int num_bytes) const
 {
     const int ncopy = MaxConsumable(num_bytes);
-    memmove(buf, consumer_, ncopy);
+    memmove(buf, Consumer(), ncopy);
     return ncopy;
 }
 
 IOBuffer::IOBuffer()
     : buf_list_(),
-      byte_count_(0)
+      byte_count_(0),
+      coalesce_(),
+      watermarks_()
 {
 }
 
 IOBuffer::~IOBuffer()
 {
 }
+
+struct IOBuffer::Watermarks {
+    int low;
+    int high;
+    bool above;
+    std::function<void(bool above_high)> callback;
+};
+
+// Checks the watermarks of a buffer as the operation changing it returns,
+// whichever way it returns.
+class IOBuffer::WatermarkCheck {
+public:
+    explicit WatermarkCheck(IOBuffer* buf) : buf_(buf) {}
+    ~WatermarkCheck()
+    {
+        if(buf_ && buf_->watermarks_) {
+            buf_->CheckWatermarks();
+        }
+    }
+
+private:
+    IOBuffer* const buf_;
+};
+
+void IOBuffer::SetWatermarks(int low, int high, const std::function<void(bool above_high)>& callback)
+{
+    if(high <= 0 || ! callback) {
+        watermarks_.reset();
+        return;
+    }
+    watermarks_.reset(new Watermarks());
+    watermarks_->low = std::min(low, high);
+    watermarks_->high = high;
+    watermarks_->above = false;
+    watermarks_->callback = callback;
+    CheckWatermarks();
+}
+
+bool IOBuffer::IsAboveHighWatermark() const
+{
+    return watermarks_ && watermarks_->above;
+}
+
+void IOBuffer::CheckWatermarks()
+{
+    Watermarks* const watermarks = watermarks_.get();
+    if(! watermarks) {
+        return;
+    }
+    if(! watermarks->above && byte_count_ >= watermarks->high) {
+        watermarks->above = true;
+        watermarks->callback(true);
+    } else if(watermarks->above && byte_count_ <= watermarks->low) {
+        watermarks->above = false;
+        watermarks->callback(false);
+    }
+}
     
 IOBuffer* IOBuffer::Clone() const 
 {
@@ -268,6 +507,7 @@ IOBuffer* IOBuffer::Clone() const
 
 void IOBuffer::Append(const IOBufferData& buf)
 {
+    WatermarkCheck check(this);
    buf_list_.push_back(buf);
    assert(byte_count_ >= 0);
 
@@ -276,24 +516,23 @@ void IOBuffer::Append(const IOBufferData& buf)
 
 int IOBuffer::Append(IOBuffer* io_buf)
 {
+    WatermarkCheck check(this), check_other(io_buf);
    if(!io_buf) {
        return -1;
    }
 
     int nbytes = 0;
     BList::iterator it;
-    for(it = io_buf->buf_list_.begin(); it != io_buf->buf_list_.end(); ) {
+    for(it = io_buf->buf_list_.begin(); it != io_buf->buf_list_.end(); it++) {
         const int nb = it->BytesConsumable(); 
         if(nb > 0) {
-            buf_list_.splice(buf_list_.end(), io_buf->buf_list_, it++);
+            buf_list_.push_back(std::move(*it));
             nbytes += nb;
-        } else {
-            it = io_buf->buf_list_.erase(it);
         }
     }
+    io_buf->buf_list_.clear();
     
-    assert(byte_count_ >= 0 && 
-        io_buf->byte_count_ == nbytes && io_buf->buf_list_.empty());
+    assert(byte_count_ >= 0 && io_buf->byte_count_ == nbytes);
     io_buf->byte_count_ = 0;
     byte_count_ += nbytes;
 
@@ -302,9 +541,10 @@ int IOBuffer::Append(IOBuffer* io_buf)
 
 void IOBuffer::Move(IOBuffer* other)
 {
-   assert(other && other->byte_count_ >=0 && byte_count_ >> 0); 
+    WatermarkCheck check(this), check_other(other);
+   assert(other && other->byte_count_ >= 0 && byte_count_ >= 0);
 
-   buf_list_.splice(buf_list_.end(), other->buf_list_);
+   buf_list_.splice_back(&other->buf_list_);
     
    byte_count_ += other->byte_count_;
    other->byte_count_ = 0;
@@ -312,6 +552,7 @@ void IOBuffer::Move(IOBuffer* other)
 
 int IOBuffer::Move(IOBuffer* other, int num_bytes)
 {
+    WatermarkCheck check(this), check_other(other);
     if(! other || num_bytes < 0) {
         return -1;
     }
@@ -327,11 +568,10 @@ int IOBuffer::Move(IOBuffer* other, int num_bytes)
         const int nb = data.BytesConsumable();
         if(to_moved > nb) {
             if(nb > 0) {
-                buf_list_.splice(buf_list_.end(), other->buf_list_, other->buf_list_.begin());
+                buf_list_.push_back(std::move(data));
                 to_moved -= nb;
-            } else {
-                other->buf_list_.pop_front();
             }
+            other->buf_list_.pop_front();
         }
         else {
             buf_list_.push_back(IOBufferData(data, data.Consumer(), data.Consumer() + to_moved));
@@ -353,6 +593,7 @@ int IOBuffer::Move(IOBuffer* other, int num_bytes)
 
 void IOBuffer::ZeroFill(int num_bytes)
 {
+    WatermarkCheck check(this);
     while(!buf_list_.empty() && buf_list_.back().IsEmpty()) {
         buf_list_.pop_back();
     }
@@ -374,6 +615,7 @@ void IOBuffer::ZeroFill(int num_bytes)
 
 int IOBuffer::CopyIn(const char* buf, int num_bytes)
 {
+    WatermarkCheck check(this);
     if(! buf || num_bytes < 0) {
         return -1;
     }
@@ -392,7 +634,7 @@ int IOBuffer::CopyIn(const char* buf, int num_bytes)
         cur += nb;
         nbytes -= nb;
         
-        assert(nb == 0 || buf_list_.back().IsFull());
+        assert(nbytes == 0 || buf_list_.back().IsFull());
     }
 
     nbytes = num_bytes - nbytes;
@@ -405,6 +647,7 @@ int IOBuffer::CopyIn(const char* buf, int num_bytes)
 
 int IOBuffer::Copy(const IOBuffer* other, int num_bytes)
 {
+    WatermarkCheck check(this);
     if(! other || num_bytes < 0) {
         return -1;
     }
@@ -415,8 +658,7 @@ int IOBuffer::Copy(const IOBuffer* other, int num_bytes)
         if(nb > 0) {
             char* const c = const_cast<char*>(it->Consumer());
             buf_list_.push_back(IOBufferData(*it, c, c + nb));
-        } else {
-            continue;
+            nbytes -= nb;
         }
     }
     
@@ -436,9 +678,6 @@ int IOBuffer::CopyOut(char* buf, int num_bytes) const
     BList::const_iterator it;
     int nbytes = num_bytes;
 
-    if(nbytes > 0) {
-        *cur = '\0';
-    }
     for(it = buf_list_.begin(); nbytes > 0 && it != buf_list_.end(); it++) {
         const int nb = it->CopyOut(cur, nbytes);
         cur += nb;
@@ -449,8 +688,70 @@ int IOBuffer::CopyOut(char* buf, int num_bytes) const
 
 }
 
+const char* IOBuffer::Peek(int length) const
+{
+    if(length <= 0 || length > byte_count_) {
+        return NULL;
+    }
+    for(BList::const_iterator it = buf_list_.begin(); it != buf_list_.end(); it++) {
+        if(! it->IsEmpty()) {
+            return int(it->BytesConsumable()) >= length ? it->Consumer() : NULL;
+        }
+    }
+    return NULL;
+}
+
+char* IOBuffer::AppendSpace(int* size)
+{
+    // no watermark check: most of the space is usually trimmed right away.
+    if(buf_list_.empty() || buf_list_.back().IsFull()) {
+        buf_list_.push_back(IOBufferData());
+    }
+    IOBufferData& last = buf_list_.back();
+
+    char* const space = last.Producer();
+    *size = last.Fill(last.SpaceAvailable());
+    byte_count_ += *size;
+    return space;
+}
+
+IOBuffer::SegmentIterator::SegmentIterator(const IOBuffer& buf, int offset)
+    : buf_(&buf),
+      index_(0),
+      data_(0),
+      size_(0)
+{
+    Load(std::max(0, offset));
+}
+
+void IOBuffer::SegmentIterator::Next()
+{
+    index_++;
+    Load(0);
+}
+
+// point at the block at index_ or the first nonempty one after it, skip
+// bytes in.
+void IOBuffer::SegmentIterator::Load(int skip)
+{
+    const BList& blist = buf_->buf_list_;
+    for( ; index_ < blist.size(); index_++) {
+        const IOBufferData& data = blist[index_];
+        const int nb = data.BytesConsumable();
+        if(nb > skip) {
+            data_ = data.Consumer() + skip;
+            size_ = nb - skip;
+            return;
+        }
+        skip -= nb;
+    }
+    data_ = 0;
+    size_ = 0;
+}
+
 int IOBuffer::Consume(int num_bytes)
 {
+    WatermarkCheck check(this);
     if(num_bytes >= byte_count_) {
         buf_list_.clear();
         const int nbytes = byte_count_;
@@ -459,13 +760,10 @@ int IOBuffer::Consume(int num_bytes)
     }
 
     int nbytes = num_bytes;
-    BList::iterator it = buf_list_.begin();
-    while(nbytes > 0 && it != buf_list_.end()) {
-        nbytes -= it->Consume(nbytes);
-        if(it->IsEmpty()) {
-            it = buf_list_.erase(it);
-        } else {
-            it++;
+    while(nbytes > 0 && ! buf_list_.empty()) {
+        nbytes -= buf_list_.front().Consume(nbytes);
+        if(buf_list_.front().IsEmpty()) {
+            buf_list_.pop_front();
         }
     }
 
@@ -476,14 +774,9 @@ int IOBuffer::Consume(int num_bytes)
     return nbytes;
 }
 
-inline static void* AllocaBuffer(size_t alloc_size)
-{
-    return s_io_buffer_allocator ? 
-        s_io_buffer_allocator->Allocate() : new char[alloc_size];
-}
-
 int IOBuffer::Trim(int num_bytes)
 {
+    WatermarkCheck check(this);
     if(num_bytes >= byte_count_) {
         return byte_count_;
     }
@@ -495,26 +788,23 @@ int IOBuffer::Trim(int num_bytes)
     }
 
     int nbytes = num_bytes;
-    BList::iterator it = buf_list_.begin();
+    size_t i = 0;
 
-    while(it != buf_list_.end()) {
-        const int nb = it->BytesConsumable();
-        if(nb <= 0) {
-            it = buf_list_.erase(it);
-        } else {
-            if(nb > nbytes) {
-                it->Trim(nbytes);
-                if( ! it->IsEmpty()) {
-                    ++it;
-                }
-                break;
+    while(i < buf_list_.size()) {
+        IOBufferData& data = buf_list_[i];
+        const int nb = data.BytesConsumable();
+        if(nb > nbytes) {
+            data.Trim(nbytes);
+            if( ! data.IsEmpty()) {
+                ++i;
             }
-            nbytes -= nb;
-            it++;
+            break;
         }
+        nbytes -= nb;
+        i++;
     }
 
-    it = buf_list_.erase(it, buf_list_.end());
+    buf_list_.truncate(i);
     assert(byte_count_ >= 0);
     byte_count_ = num_bytes;
     return byte_count_;
@@ -522,13 +812,12 @@ int IOBuffer::Trim(int num_bytes)
 
 int IOBuffer::Read(int fd, int max_read_ahead)
 {
+    WatermarkCheck check(this);
     if(s_io_buffer_allocator && ! s_used_io_buffer_allocator) {
         IOBufferData init_with_allocator;
     } 
 
-    const size_t buf_size = s_io_buffer_allocator ? 
-        s_io_buffer_allocator->GetBufferSize() : 
-        IOBufferData::default_buffer_size();
+    const size_t buf_size = IOBufferData::default_buffer_size();
     if(max_read_ahead > 0 && max_read_ahead <= int(buf_size)) {
         if(buf_list_.empty()) {
             buf_list_.push_back(IOBufferData());
@@ -548,41 +837,39 @@ int IOBuffer::Read(int fd, int max_read_ahead)
             std::min(kMaxReadvNum, int(kMaxReadv / buf_size + 1))); 
     struct iovec read_iov[kMaxReadvNum];
     ssize_t total_read = 0;
-    bool use_last = ! buf_list_.empty() && ! buf_list_.back().IsFull();
 
     ssize_t max_read = (max_read_ahead >= 0 ?
             max_read_ahead : std::numeric_limits<int>::max());
    
     while(max_read > 0) {
-        assert(use_last || buf_list_.empty() || buf_list_.back().IsFull());
-       
+        // read straight into new blocks appended to the list, addressed by
+        // index as appending may move the IOBufferData; the ones left
+        // empty are dropped again.
+        const size_t orig_blocks = buf_list_.size();
+        size_t first = orig_blocks;
+        if(! buf_list_.empty() && ! buf_list_.back().IsFull()) {
+            first--;
+        }
+
         int nvec = 0;
         ssize_t nread = max_read;
         size_t nbytes(nread);
 
-        if(use_last) {
-            IOBufferData buf = buf_list_.back();
-            const size_t nb = std::min(nbytes, buf.SpaceAvailable());
-            read_iov[nvec].iov_base = buf.Producer();
-            read_iov[nvec].iov_len = nb;
-            nvec++;
-            nbytes -= nb;
-        }
-
-        for( ; nbytes > 0 && nvec < max_readv_num; nvec++) {
-            const size_t nb = std::min(nbytes, buf_size);
-            read_iov[nvec].iov_len = nb;
-            if (! (read_iov[nvec].iov_base = AllocaBuffer(nb))) {
-                if(total_read <= 0 && nvec <= 0) {
-                    abort(); // Allocation failure.
-                }
-                break;
+        for(size_t i = first; nbytes > 0 && nvec < max_readv_num; i++) {
+            if(i == buf_list_.size()) {
+                buf_list_.push_back(IOBufferData());
             }
+            IOBufferData& data = buf_list_[i];
+            const size_t nb = std::min(nbytes, data.SpaceAvailable());
+            read_iov[nvec].iov_base = data.Producer();
+            read_iov[nvec].iov_len = nb;
             nbytes -= nb;
+            nvec++;
         }
         nread -= nbytes;
 
         const ssize_t rd = readv(fd, read_iov, nvec);
+        const int err = errno; // freeing the empty blocks may clobber it
         if(rd < nread) {
             max_read = 0; // short read, eof or error: we're done.
         } else if (max_read > 0) {
@@ -591,38 +878,18 @@ int IOBuffer::Read(int fd, int max_read_ahead)
         }
         
         nread = std::max(ssize_t(0), rd);
-        int i = 0;
-
-        if(use_last) {
-            nread -= buf_list_.back().Fill(nread);
-            i++;
-            use_last = false;
-        }
-       
-        for( ; i < nvec; i++) {
-            char* const buf = reinterpret_cast<char*>(read_iov[nvec].iov_base);
-            if(nread > 0) {
-                if(s_io_buffer_allocator) {
-                    buf_list_.push_back(
-                        IOBufferData(buf, 0, nread, *s_io_buffer_allocator));
-                } else {
-                    buf_list_.push_back(
-                        IOBufferData(buf, buf_size, 0, nread));
-                }
-                nread -=  buf_list_.back().BytesConsumable();
-            } else {
-                if(s_io_buffer_allocator) {
-                    s_io_buffer_allocator->Deallocate(buf);
-                } else {
-                    delete [] buf;
-                }
-           }
+        for(size_t i = first; nread > 0 && i < buf_list_.size(); i++) {
+            nread -= buf_list_[i].Fill(nread);
         }
         assert(nread == 0);
+        while(buf_list_.size() > orig_blocks && buf_list_.back().IsEmpty()) {
+            buf_list_.pop_back();
+        }
+
         if(rd > 0) {
             total_read += rd;
         } else if(total_read == 0 && rd < 0 &&
-            (total_read = (errno == 0 ? EAGAIN : -errno)) > 0) {
+            (total_read = (err == 0 ? EAGAIN : -err)) > 0) {
             total_read = -total_read;
         }
     }
@@ -634,8 +901,119 @@ int IOBuffer::Read(int fd, int max_read_ahead)
     return total_read;
 }
 
+bool IOBuffer::ShouldCoalesce() const
+{
+    const int nblocks = buf_list_.size();
+    if(nblocks < 2) {
+        return false;
+    }
+    return (coalesce_.max_fragments > 0 && nblocks > coalesce_.max_fragments) ||
+        (coalesce_.min_average_size > 0 && byte_count_ / nblocks < coalesce_.min_average_size);
+}
+
+int IOBuffer::Coalesce()
+{
+    return CoalesceHead(std::numeric_limits<int>::max(), std::numeric_limits<int>::max());
+}
+
+int IOBuffer::CoalesceHead(int max_blocks, int max_bytes)
+{
+    const size_t nblocks = buf_list_.size();
+    const int small = coalesce_.small_fragment_size;
+    const int fresh_size = IOBufferData::default_buffer_size();
+
+    // find the head that makes max_blocks blocks once merged, or max_bytes,
+    // and whether it has a run of small blocks at all.
+    size_t end = 0;
+    bool any_run = false;
+    bool fresh = false;
+    int room = 0;   // left in the last fresh block
+    for(int nmerged = 0, nbytes = 0;
+            end < nblocks && nmerged < max_blocks && nbytes < max_bytes; end++) {
+        const int nb = buf_list_[end].BytesConsumable();
+        if(nb <= 0) {
+            continue;
+        }
+        nbytes += nb;
+        const bool run = nb < small && (fresh ||
+                (end + 1 < nblocks && int(buf_list_[end + 1].BytesConsumable()) < small));
+        if(! run) {
+            nmerged++;
+            fresh = false;
+            continue;
+        }
+        any_run = true;
+        int left = nb;
+        while(left > 0) {
+            if(! fresh || room <= 0) {
+                nmerged++;
+                fresh = true;
+                room = fresh_size;
+            }
+            const int ncopy = std::min(left, room);
+            room -= ncopy;
+            left -= ncopy;
+        }
+    }
+    if(! any_run) {
+        return 0; // nothing to copy: leave the blocks alone.
+    }
+
+    BList merged;
+    fresh = false; // whether merged.back() is a fresh block small ones are copied into.
+    for(size_t i = 0; i < end; i++) {
+        IOBufferData& data = buf_list_[i];
+        const int nb = data.BytesConsumable();
+        if(nb <= 0) {
+            continue;
+        }
+        // a small block is copied only as part of a run: on its own it
+        // would take an iovec all the same.
+        const bool run = nb < small && (fresh ||
+                (i + 1 < nblocks && int(buf_list_[i + 1].BytesConsumable()) < small));
+        if(! run) {
+            merged.push_back(std::move(data));
+            fresh = false;
+            continue;
+        }
+        const char* cur = data.Consumer();
+        int nbytes = nb;
+        while(nbytes > 0) {
+            if(! fresh || merged.back().IsFull()) {
+                merged.push_back(IOBufferData());
+                fresh = true;
+            }
+            const int ncopy = merged.back().CopyIn(cur, nbytes);
+            cur += ncopy;
+            nbytes -= ncopy;
+        }
+    }
+
+    const size_t nmerged = merged.size();
+    if(nmerged <= end) {
+        // put the merged blocks in place of the last ones of the head, and
+        // pop the others: the rest of the list is not touched.
+        for(size_t i = 0; i < nmerged; i++) {
+            buf_list_[end - nmerged + i] = std::move(merged[i]);
+        }
+        for(size_t i = nmerged; i < end; i++) {
+            buf_list_.pop_front();
+        }
+    } else {
+        // blocks smaller than small_fragment_size: the head grew.
+        for(size_t i = end; i < nblocks; i++) {
+            merged.push_back(std::move(buf_list_[i]));
+        }
+        buf_list_.clear();
+        buf_list_.splice_back(&merged);
+    }
+    return int(nblocks) - int(buf_list_.size());
+}
+
 int IOBuffer::Write(int fd)
 {
+    WatermarkCheck check(this);
+
     const int kMaxWritevNum = 32;
     const int max_write_num = std::min(IOV_MAX, kMaxWritevNum);
     const int kPreferredWriteSize = 64 << 10;
@@ -644,22 +1022,24 @@ int IOBuffer::Write(int fd)
     ssize_t total_write = 0;
 
     while(! buf_list_.empty()) {
+        // only what this writev(2) is going to take.
+        if(ShouldCoalesce()) {
+            CoalesceHead(max_write_num, kPreferredWriteSize);
+        }
         BList::iterator it;
         int nvec;
         ssize_t to_write;
         for(it = buf_list_.begin(), nvec = 0, to_write = 0;
-            it != buf_list_.end() && nvec < max_write_num && total_write < kPreferredWriteSize;
-            ) {
+            it != buf_list_.end() && nvec < max_write_num && to_write < kPreferredWriteSize;
+            it++) {
             const int nbytes = it->BytesConsumable();
             if(nbytes <= 0 ) {
-                it = buf_list_.erase(it);
-                continue;
+                continue; // popped below with the blocks written
             } 
             write_iov[nvec].iov_len = nbytes;
             write_iov[nvec].iov_base = it->Consumer();
             to_write += nbytes;
             nvec++;
-            it++;
         }
 
         if(nvec <= 0) {
@@ -674,7 +1054,7 @@ int IOBuffer::Write(int fd)
         } else {
             ssize_t to_erase = nw;
             int nb;
-            while((nb = buf_list_.front().BytesConsumable()) <= to_erase) {
+            while(! buf_list_.empty() && (nb = buf_list_.front().BytesConsumable()) <= to_erase) {
                 to_erase -= nb;
                 buf_list_.pop_front();
             }
@@ -704,4 +1084,105 @@ int IOBuffer::Write(int fd)
     return total_write;
 }
 
+int IOBuffer::SendTo(int fd, const struct sockaddr* addr, int addr_len)
+{
+    const int kMaxSendmsgNum = 64;
+    const int max_send_num = std::min(IOV_MAX, kMaxSendmsgNum);
+
+    struct iovec send_iov[kMaxSendmsgNum];
+    int nvec = 0;
+
+    BList::iterator it;
+    for(it = buf_list_.begin(); it != buf_list_.end(); it++) {
+        const int nbytes = it->BytesConsumable();
+        if(nbytes <= 0) {
+            continue;
+        }
+        if(nvec >= max_send_num) {
+            return -EMSGSIZE; // a datagram can not be split.
+        }
+        send_iov[nvec].iov_len = nbytes;
+        send_iov[nvec].iov_base = it->Consumer();
+        nvec++;
+    }
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = const_cast<struct sockaddr*>(addr);
+    msg.msg_namelen = addr_len;
+    msg.msg_iov = send_iov;
+    msg.msg_iovlen = nvec;
+
+    const ssize_t nsent = sendmsg(fd, &msg, 0);
+    if(nsent < 0) {
+        return (errno > 0 ? -errno : -EAGAIN);
+    }
+
+    assert(nsent == byte_count_);
+    Clear();
+    return nsent;
+}
+
+int IOBuffer::RecvFrom(int fd, int max_size, struct sockaddr* addr, int* addr_len)
+{
+    WatermarkCheck check(this);
+    const int kMaxRecvmsgNum = 17;
+    const int max_recv_num = std::min(IOV_MAX, kMaxRecvmsgNum);
+
+    struct iovec recv_iov[kMaxRecvmsgNum];
+    int nvec = 0;
+    int nbytes = max_size;
+
+    // blocks are addressed by index: appending may move the IOBufferData
+    // (not the data they point to).
+    const size_t orig_blocks = buf_list_.size();
+    size_t first = orig_blocks;
+    if(! buf_list_.empty() && ! buf_list_.back().IsFull()) {
+        first--;
+    }
+
+    for(size_t i = first; nbytes > 0 && nvec < max_recv_num; i++) {
+        if(i == buf_list_.size()) {
+            buf_list_.push_back(IOBufferData());
+        }
+        IOBufferData& data = buf_list_[i];
+        const int nb = std::min(nbytes, int(data.SpaceAvailable()));
+        recv_iov[nvec].iov_base = data.Producer();
+        recv_iov[nvec].iov_len = nb;
+        nbytes -= nb;
+        nvec++;
+    }
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = addr;
+    msg.msg_namelen = (addr && addr_len) ? *addr_len : 0;
+    msg.msg_iov = recv_iov;
+    msg.msg_iovlen = nvec;
+
+    ssize_t nread = recvmsg(fd, &msg, 0);
+    const int err = errno;
+    if(nread > 0 && (msg.msg_flags & MSG_TRUNC)) {
+        nread = -EMSGSIZE;
+    }
+
+    int nfill = std::max(ssize_t(0), nread);
+    for(size_t i = first; nfill > 0 && i < buf_list_.size(); i++) {
+        nfill -= buf_list_[i].Fill(nfill);
+    }
+    assert(nfill == 0);
+    while(buf_list_.size() > orig_blocks && buf_list_.back().IsEmpty()) {
+        buf_list_.pop_back();
+    }
+
+    if(nread < 0) {
+        return (nread == -EMSGSIZE ? nread : (err > 0 ? -err : -EAGAIN));
+    }
+    if(addr_len) {
+        *addr_len = msg.msg_namelen;
+    }
+    byte_count_ += nread;
+    return nread;
+}
+
 } // namespace paxoslease
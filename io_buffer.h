@@ -1,9 +1,15 @@
 #ifndef PAXOSLEASE_IO_BUFFER_H
 #define PAXOSLEASE_IO_BUFFER_H
 
-#include <list>
+#include <atomic>
+#include <functional>
 #include <memory>
 #include <stddef.h>
+#include <stdint.h>
+
+#include "inline_deque.h"
+
+struct sockaddr;
 
 namespace paxoslease {
 
@@ -19,18 +25,106 @@ public:
 
 bool SetIOBufferAllocator(IOBufferAllocator* allocator);
 
+/// Count the references to blocks created from now on with plain loads and
+/// stores instead of atomic instructions. Only for processes where an
+/// IOBuffer and everything sharing its blocks (Clone(), Copy(), Move())
+/// never leave one thread.
+void SetIOBufferAtomicRefcount(bool atomic);
+
+/// Data bytes of all live blocks in the process, whoever holds them.
+int64_t IOBufferMemoryUsage();
+
+/// Called with true when IOBufferMemoryUsage() rises to the high
+/// watermark, and with false when it falls back to the low one, so the
+/// network layer can stop reading or drop low-priority traffic in between.
+typedef std::function<void(bool above_high, int64_t usage)> IOBufferMemoryCallback;
+
+/// Set the process-wide watermarks, high <= 0 turns them off. Like
+/// SetIOBufferAllocator(), call it before IOBuffers are in use.
+///
+/// Note: the callback runs on a thread whose allocation or free crossed
+/// the watermark, inside it, one call at a time: keep it short, and don't
+/// set the watermarks from it. It may allocate and free IOBuffers; a
+/// crossing meanwhile is reported once it returns.
+void SetIOBufferMemoryWatermarks(int64_t low, int64_t high, const IOBufferMemoryCallback& callback);
+
+/// Whether the usage went above the high watermark and not yet back down
+/// to the low one.
+bool IOBufferMemoryAboveHigh();
+
+/// Header of a data block, shared by every IOBufferData pointing into it.
+/// Blocks allocated by IOBufferData carry it in front of their data, in the
+/// same allocation; only blocks handed in by the caller get a separate one.
+struct IOBufferBlock {
+    enum Kind {
+        kArray,             // header + data from new char[]
+        kAllocator,         // header + data from allocator
+        kExternalArray,     // data from the caller, freed with delete []
+        kExternalAllocator  // data from the caller, freed by allocator
+    };
+
+    std::atomic<int32_t> refs;
+    uint8_t kind;
+    bool atomic;            // see SetIOBufferAtomicRefcount()
+    uint32_t size;          // bytes at data
+    IOBufferAllocator* allocator;
+    char* data;
+
+    void Ref()
+    {
+        if(atomic) {
+            refs.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            refs.store(refs.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        }
+    }
+
+    /// Free the block when the last reference goes.
+    void Unref()
+    {
+        int32_t left;
+        if(atomic) {
+            left = refs.fetch_sub(1, std::memory_order_acq_rel) - 1;
+        } else {
+            left = refs.load(std::memory_order_relaxed) - 1;
+            refs.store(left, std::memory_order_relaxed);
+        }
+        if(left == 0) {
+            Free();
+        }
+    }
+
+    bool IsShared() const { return refs.load(std::memory_order_acquire) > 1; }
+
+private:
+    void Free();
+};
+
+/// A slice of an IOBufferBlock: the block pointer plus 32 bit offsets of
+/// the consumer, producer and end positions in its data, three words in all.
+/// Copying one shares the block at the cost of one reference increment.
 class IOBufferData {
 public:
     IOBufferData();
     IOBufferData(int buf_size);
     IOBufferData(char* buf, int offset, int size, IOBufferAllocator& allocator);
     IOBufferData(char* buf, int buf_size, int offset, int size);
+    /// Take over block, a block of allocator's that did not come from
+    /// IOBufferData(): its header goes in front of the data, the first
+    /// block_header_size() bytes, and size bytes of data after it are
+    /// already filled. allocator.Deallocate(block) frees it.
+    IOBufferData(IOBufferAllocator& allocator, char* block, int size);
 
     /// Create an IOBufferData blob by sharing data block from other, set the 
     /// producer_/consumer_ based on the start/end positions that are passed in.
     IOBufferData(const IOBufferData &other, char* s, char* e, char* p = 0);
     ~IOBufferData();
 
+    IOBufferData(const IOBufferData& other);
+    IOBufferData(IOBufferData&& other);
+    IOBufferData& operator =(const IOBufferData& other);
+    IOBufferData& operator =(IOBufferData&& other);
+
     int Read(int fd, int max_read_ahead);
 
     int Write(int fd);
@@ -53,10 +147,10 @@ public:
     /// Note: As a result of copy, the "consumer_" pointer is not advanced.
     int CopyOut(char* buf, int num_bytes) const;
 
-    inline char* Producer() { return producer_; }
-    inline char* Consumer() { return consumer_; }
-    inline const char* Producer() const { return producer_; }
-    inline const char* Consumer() const { return consumer_; }
+    inline char* Producer() { return block_->data + producer_; }
+    inline char* Consumer() { return block_->data + consumer_; }
+    inline const char* Producer() const { return block_->data + producer_; }
+    inline const char* Consumer() const { return block_->data + consumer_; }
 
     // some data has been filled in the buffer. So advance producer_
     int Fill(int num_bytes);
@@ -75,18 +169,19 @@ public:
     bool IsEmpty() const { return producer_ <= consumer_; }
 
     bool IsShared() const {
-        return (!data_share_ptr_.unique());
+        return block_->IsShared();
     }
 
+    /// Data bytes of a block allocated by IOBufferData().
     static int default_buffer_size() { return default_buffer_size_; }
+    /// Bytes in front of the data of a block that carries its header.
+    static int block_header_size();
 
 private:
-    typedef std::shared_ptr<char> IOBufferBlockPtr;
-
-    IOBufferBlockPtr data_share_ptr_;
-    char* end_;
-    char* producer_;
-    char* consumer_;
+    IOBufferBlock* block_;
+    uint32_t end_;
+    uint32_t producer_;
+    uint32_t consumer_;
 
     inline void Init(char* buf, int buf_size);
     inline void Init(char* buf, IOBufferAllocator& allocator);
@@ -100,11 +195,43 @@ private:
 
 /// An IOBuffer consists of a list of IOBufferData. Operations on IOBuffer
 /// transfers to operations on appropriate IOBufferData.
+///
+/// The list is a ring kept inside the IOBuffer for the first kInlineBlocks
+/// blocks, so the common one or two block buffer allocates nothing for it.
 
 class IOBuffer {
 private:
-    typedef std::list<IOBufferData> BList;
+    static const size_t kInlineBlocks = 2;
+    typedef InlineDeque<IOBufferData, kInlineBlocks> BList;
 public:
+    /// Walks the consumable bytes of an IOBuffer one block at a time,
+    /// skipping empty blocks, without copying:
+    ///
+    ///   for(IOBuffer::SegmentIterator it(buf); ! it.Done(); it.Next()) {
+    ///       use(it.data(), it.size());
+    ///   }
+    ///
+    /// Note: the IOBuffer must not be modified while iterating.
+    class SegmentIterator {
+    public:
+        /// Start offset bytes into the buffer.
+        explicit SegmentIterator(const IOBuffer& buf, int offset = 0);
+
+        bool Done() const { return size_ <= 0; }
+        const char* data() const { return data_; }
+        int size() const { return size_; }
+
+        void Next();
+
+    private:
+        void Load(int skip);
+
+        const IOBuffer* buf_;
+        size_t index_;
+        const char* data_;
+        int size_;
+    };
+
     IOBuffer();
     ~IOBuffer();
 
@@ -145,6 +272,16 @@ public:
     /// NOTE: As a result of copy, the "consumer_" pointer of an IOBufferData is not
     /// advanced.
     int CopyOut(char* buf, int num_bytes) const;
+
+    /// The first length bytes in place when they lie in one block, NULL
+    /// when they do not (or there are fewer); CopyOut() them then.
+    const char* Peek(int length) const;
+
+    /// Hand out the free space at the tail of the buffer, adding a block
+    /// when the last one is full, and count all *size bytes of it as data
+    /// right away; Trim() gives back what is not written. The watermarks
+    /// are left alone until then, or until CheckWatermarks().
+    char* AppendSpace(int* size);
     
     /// Consuming the data in the IOBuffer translates to advancing the "consumer_" 
     /// pointer on underlying IOBufferData. From the first of the list, the "consumer_"
@@ -161,16 +298,85 @@ public:
 
     int Read(int fd, int max_read_ahead = -1);
 
+    /// Write with writev(2), at most 32 blocks and about 64KB per call.
+    /// When the coalescing policy says so, runs of small adjacent blocks
+    /// about to be written are first copied into fresh blocks, so a buffer
+    /// assembled from many small messages still goes out 64KB per call.
     int Write(int fd);
 
+    /// When Write() coalesces: if the buffer has more than max_fragments
+    /// blocks, or its blocks hold fewer than min_average_size bytes on
+    /// average (0 turns either off), runs of two or more adjacent blocks
+    /// smaller than small_fragment_size are merged. Larger blocks are
+    /// never copied.
+    struct CoalescePolicy {
+        CoalescePolicy(int max_fragments = 32, int min_average_size = 0,
+                int small_fragment_size = 1 << 10)
+            : max_fragments(max_fragments),
+              min_average_size(min_average_size),
+              small_fragment_size(small_fragment_size)
+        {
+        }
+
+        int max_fragments;
+        int min_average_size;
+        int small_fragment_size;
+    };
+
+    void SetCoalescePolicy(const CoalescePolicy& policy) { coalesce_ = policy; }
+    const CoalescePolicy& coalesce_policy() const { return coalesce_; }
+
+    /// Merge small blocks as described by the policy, whether or not it
+    /// would trigger. Returns the # of blocks merged away.
+    int Coalesce();
+
+    /// Send the whole buffer as a single datagram with sendmsg(2), one iovec
+    /// per IOBufferData. On success the buffer is consumed. Returns the # of
+    /// bytes sent or -errno.
+    int SendTo(int fd, const struct sockaddr* addr, int addr_len);
+
+    /// Receive one datagram of at most max_size bytes with recvmsg(2) and
+    /// append it to the buffer, filling the free space of the last
+    /// IOBufferData first. A datagram larger than max_size is dropped.
+    /// Returns the # of bytes received or -errno (-EMSGSIZE if truncated).
+    int RecvFrom(int fd, int max_size, struct sockaddr* addr, int* addr_len);
+
     void Clear() {
         buf_list_.clear();
         byte_count_ = 0;
+        if(watermarks_) {
+            CheckWatermarks();
+        }
     }
 
+    /// Called with true when BytesConsumable() rises to high, and with
+    /// false when it falls back to low, e.g. to stop producing into the
+    /// outbound buffer of a slow peer. high <= 0 turns them off.
+    ///
+    /// Note: the callback runs inside the operation that crossed the
+    /// watermark and must not modify this buffer.
+    void SetWatermarks(int low, int high, const std::function<void(bool above_high)>& callback);
+
+    bool IsAboveHighWatermark() const;
+
+    /// Call the watermark callback if the buffer crossed one since the last
+    /// check. Operations changing the buffer do it themselves, except
+    /// AppendSpace().
+    void CheckWatermarks();
+
 private:
+    struct Watermarks;
+    class WatermarkCheck;
+
+    bool ShouldCoalesce() const;
+    /// Coalesce the head of the buffer that makes max_blocks blocks, or
+    /// max_bytes, once merged; the blocks after it are left alone.
+    int CoalesceHead(int max_blocks, int max_bytes);
+
     BList buf_list_;
     int byte_count_;
+    CoalescePolicy coalesce_;
+    std::unique_ptr<Watermarks> watermarks_;
 
     IOBuffer(const IOBuffer&);
     IOBuffer& operator =(const IOBuffer&);
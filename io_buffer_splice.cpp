@@ -0,0 +1,229 @@
+#include "io_buffer_splice.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+namespace paxoslease {
+
+IOBufferSplicer::IOBufferSplicer(int pipe_size)
+    : pipe_size_(pipe_size),
+      pending_(0),
+      copy_pending_(0),
+      copy_failed_(false),
+      pinned_()
+{
+    pipe_[0] = pipe_[1] = -1;
+    copy_pipe_[0] = copy_pipe_[1] = -1;
+    if(! Open(pipe_, pipe_size_)) {
+        return;
+    }
+    const int size = ::fcntl(pipe_[0], F_GETPIPE_SZ);
+    pipe_size_ = (size > 0 ? size : 64 << 10);
+}
+
+IOBufferSplicer::~IOBufferSplicer()
+{
+    for(int i = 0; i < 2; i++) {
+        if(pipe_[i] >= 0) {
+            ::close(pipe_[i]);
+        }
+    }
+    CloseCopy();
+}
+
+bool IOBufferSplicer::Open(int* fds, int pipe_size)
+{
+    if(::pipe2(fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+        fds[0] = fds[1] = -1;
+        return false;
+    }
+    if(pipe_size > 0) {
+        // only a hint: the default 64KB pipe works, in more calls.
+        ::fcntl(fds[0], F_SETPIPE_SZ, pipe_size);
+    }
+    return true;
+}
+
+int64_t IOBufferSplicer::Drain(int pipe_out, int fd, int64_t* pending)
+{
+    int64_t written = 0;
+    while(*pending > 0) {
+        const ssize_t n = ::splice(pipe_out, NULL, fd, NULL, *pending,
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if(n > 0) {
+            written += n;
+            *pending -= n;
+        } else if(n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            return (written > 0 ? written : (n < 0 ? -errno : -EIO));
+        }
+    }
+    return written;
+}
+
+int64_t IOBufferSplicer::Transfer(int in_fd, int out_fd, int64_t num_bytes, int copy_fd,
+        int64_t* nconsumed)
+{
+    if(nconsumed) {
+        *nconsumed = 0;
+    }
+    if(! available()) {
+        return -EBADF;
+    }
+    int chunk_size = pipe_size_;
+    if(copy_fd >= 0) {
+        if(copy_failed_) {
+            return -EIO;
+        }
+        if(copy_pipe_[0] < 0 && ! Open(copy_pipe_, pipe_size_)) {
+            return (errno > 0 ? -errno : -EMFILE);
+        }
+        // a chunk must fit the copy pipe whole: tee(2) can not be resumed
+        // halfway, it always starts at the head of the pipe.
+        const int size = ::fcntl(copy_pipe_[0], F_GETPIPE_SZ);
+        chunk_size = std::min(chunk_size, size > 0 ? size : 64 << 10);
+    }
+
+    int64_t total_read = 0;
+    int64_t total_write = 0;
+    int64_t to_read = (num_bytes >= 0 ? num_bytes : INT64_MAX);
+    int err = 0;
+
+    for(;;) {
+        const int64_t nw = Drain(pipe_[0], out_fd, &pending_);
+        if(nw > 0) {
+            total_write += nw;
+        } else if(nw < 0) {
+            err = -nw;
+        }
+        if(copy_fd >= 0 && copy_pending_ > 0) {
+            const int64_t nc = Drain(copy_pipe_[0], copy_fd, &copy_pending_);
+            if(nc < 0 && err == 0) {
+                err = -nc;
+            }
+        }
+        if(pending_ > 0 || copy_pending_ > 0 || to_read <= 0) {
+            break; // out_fd or copy_fd would block, or we're done.
+        }
+
+        const size_t len = std::min<int64_t>(to_read, chunk_size);
+        const ssize_t nread = ::splice(in_fd, NULL, pipe_[1], NULL, len,
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if(nread == 0) {
+            break; // end of file
+        }
+        if(nread < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            err = errno;
+            break;
+        }
+        if(copy_fd >= 0) {
+            const ssize_t nteed = ::tee(pipe_[0], copy_pipe_[1], nread, SPLICE_F_NONBLOCK);
+            if(nteed != nread) {
+                // the copy lost bytes: don't let it go on silently. What
+                // part of the chunk made it would still come out of the
+                // copy pipe, so it goes, with whatever was left in it.
+                err = (nteed < 0 ? errno : EIO);
+                pending_ += nread;
+                total_read += nread;
+                CloseCopy();
+                copy_failed_ = true;
+                break;
+            }
+            copy_pending_ += nteed;
+        }
+        pending_ += nread;
+        total_read += nread;
+        to_read -= nread;
+    }
+
+    if(nconsumed) {
+        *nconsumed = total_read;
+    }
+    if(total_write > 0) {
+        return total_write;
+    }
+    return (err > 0 ? -err : 0);
+}
+
+void IOBufferSplicer::CloseCopy()
+{
+    for(int i = 0; i < 2; i++) {
+        if(copy_pipe_[i] >= 0) {
+            ::close(copy_pipe_[i]);
+            copy_pipe_[i] = -1;
+        }
+    }
+    copy_pending_ = 0;
+}
+
+int IOBufferSplicer::Write(IOBuffer* buf, int out_fd)
+{
+    if(! available()) {
+        return -EBADF;
+    }
+    const int kMaxVmspliceNum = 64;
+    const int max_vmsplice_num = std::min(IOV_MAX, kMaxVmspliceNum);
+    struct iovec iov[kMaxVmspliceNum];
+
+    int64_t total_write = 0;
+    int err = 0;
+
+    for(;;) {
+        const int64_t nw = Drain(pipe_[0], out_fd, &pending_);
+        if(nw > 0) {
+            total_write += nw;
+        } else if(nw < 0) {
+            err = -nw;
+        }
+        if(pending_ > 0 || buf->IsEmpty()) {
+            break;
+        }
+
+        int nvec = 0;
+        int to_splice = 0;
+        for(IOBuffer::SegmentIterator it(*buf);
+                ! it.Done() && nvec < max_vmsplice_num && to_splice < pipe_size_; it.Next()) {
+            const int nb = std::min(it.size(), pipe_size_ - to_splice);
+            iov[nvec].iov_base = const_cast<char*>(it.data());
+            iov[nvec].iov_len = nb;
+            to_splice += nb;
+            nvec++;
+        }
+
+        const ssize_t nspliced = ::vmsplice(pipe_[1], iov, nvec, SPLICE_F_NONBLOCK);
+        if(nspliced <= 0) {
+            if(nspliced < 0 && errno == EINTR) {
+                continue;
+            }
+            err = (nspliced < 0 ? errno : EIO);
+            break;
+        }
+        pinned_.Move(buf, nspliced);
+        pending_ += nspliced;
+    }
+
+    if(total_write > 0) {
+        return total_write;
+    }
+    return (err > 0 ? -err : 0);
+}
+
+void IOBufferSplicer::Unpin()
+{
+    // the pipe is a FIFO: whatever of the pinned blocks may still be in it
+    // is within the last pending_ bytes.
+    const int64_t unpin = pinned_.BytesConsumable() - pending_;
+    if(unpin > 0) {
+        pinned_.Consume(unpin);
+    }
+}
+
+} // namespace paxoslease
@@ -0,0 +1,99 @@
+#ifndef PAXOSLEASE_IO_BUFFER_SPLICE_H
+#define PAXOSLEASE_IO_BUFFER_SPLICE_H
+
+#include <stdint.h>
+
+#include "io_buffer.h"
+
+namespace paxoslease {
+
+/// Moves data between file descriptors through a kernel pipe with
+/// splice(2), tee(2) and vmsplice(2), so it never passes through user
+/// space: state snapshots and diagnostic dumps go from a file to a peer, or
+/// from a peer to disk, without an IOBuffer in between.
+///
+///   IOBufferSplicer splicer;
+///   int64_t nmoved = splicer.Transfer(snapshot_fd, peer_fd, size, disk_fd);
+///
+/// Nothing blocks on the pipe. When out_fd would block, what is left in the
+/// pipe is written first on the next call: keep calling with the same
+/// out_fd until pending() is 0 before switching to another one.
+///
+/// Note: one thread at a time may use a splicer.
+class IOBufferSplicer {
+public:
+    /// pipe_size is a hint for F_SETPIPE_SZ; the kernel may round it or
+    /// refuse it.
+    explicit IOBufferSplicer(int pipe_size = 1 << 20);
+    ~IOBufferSplicer();
+
+    /// false when the pipes could not be created; every call fails then.
+    bool available() const { return pipe_[0] >= 0; }
+
+    /// Move num_bytes, all there are until end of file or EAGAIN when
+    /// negative, from in_fd to out_fd. With copy_fd >= 0, tee(2) sends the
+    /// same bytes to copy_fd as well. Returns the # of bytes written to
+    /// out_fd, or -errno when none were.
+    ///
+    /// Bytes written include those left pending by earlier calls, so they
+    /// do not tell how far in_fd was read: *nconsumed, if given, is set to
+    /// the # of bytes this call took from in_fd, errors included. A caller
+    /// moving num_bytes in several calls subtracts it from what is left.
+    ///
+    /// If tee(2) copies only part of a chunk, the copy has a hole: what it
+    /// had not written yet is dropped, copy_failed() turns true, and calls
+    /// with a copy_fd fail with -EIO until ResetCopy(). Calls without one
+    /// go on moving the bytes to out_fd.
+    int64_t Transfer(int in_fd, int out_fd, int64_t num_bytes = -1, int copy_fd = -1,
+            int64_t* nconsumed = NULL);
+
+    /// Whether the copy of Transfer() is incomplete.
+    bool copy_failed() const { return copy_failed_; }
+    /// Let Transfer() copy again, to a copy_fd starting afresh.
+    void ResetCopy() { copy_failed_ = false; }
+
+    /// Write buf to out_fd by mapping its blocks into the pipe with
+    /// vmsplice(2) and splicing them on, consuming what was taken. Returns
+    /// the # of bytes written to out_fd, or -errno when none were.
+    ///
+    /// The kernel refers to the pages of the blocks instead of copying
+    /// them: the blocks stay pinned in the splicer until Unpin().
+    int Write(IOBuffer* buf, int out_fd);
+
+    /// Drop the blocks pinned by Write(), except those that may still sit
+    /// in the pipe. Call it only once out_fd no longer reads from them: at
+    /// once for a file, which copies into the page cache, but for a socket
+    /// only after the peer acknowledged the data.
+    void Unpin();
+
+    /// Bytes in the pipe, not yet written to out_fd.
+    int64_t pending() const { return pending_; }
+    /// Bytes tee'd into the copy pipe, not yet written to copy_fd.
+    int64_t copy_pending() const { return copy_pending_; }
+
+private:
+    static bool Open(int* fds, int pipe_size);
+
+    /// Splice what is pending in the pipe to fd. Returns the # of bytes
+    /// written, or -errno when none were and some are left.
+    static int64_t Drain(int pipe_out, int fd, int64_t* pending);
+
+    /// Close the copy pipe, dropping what is in it.
+    void CloseCopy();
+
+    int pipe_[2];
+    int copy_pipe_[2];   // opened on the first Transfer() with a copy_fd
+    int pipe_size_;
+    int64_t pending_;
+    int64_t copy_pending_;
+    bool copy_failed_;
+
+    IOBuffer pinned_;
+
+    IOBufferSplicer(const IOBufferSplicer&);
+    IOBufferSplicer& operator =(const IOBufferSplicer&);
+};
+
+} // namespace paxoslease
+
+#endif //PAXOSLEASE_IO_BUFFER_SPLICE_H
@@ -0,0 +1,91 @@
+#include "io_buffer_stream.h"
+
+#include <assert.h>
+
+namespace paxoslease {
+
+IOBufferInputStream::IOBufferInputStream(const IOBuffer* buf)
+    : it_(*buf),
+      last_data_(0),
+      last_size_(0),
+      backup_count_(0),
+      byte_count_(0)
+{
+}
+
+IOBufferInputStream::~IOBufferInputStream()
+{
+}
+
+bool IOBufferInputStream::Next(const void** data, int* size)
+{
+    if(backup_count_ > 0) {
+        last_data_ += last_size_ - backup_count_;
+        last_size_ = backup_count_;
+        backup_count_ = 0;
+    } else {
+        if(it_.Done()) {
+            return false;
+        }
+        last_data_ = it_.data();
+        last_size_ = it_.size();
+        it_.Next();
+    }
+
+    *data = last_data_;
+    *size = last_size_;
+    byte_count_ += last_size_;
+    return true;
+}
+
+void IOBufferInputStream::BackUp(int count)
+{
+    assert(count >= 0 && count <= last_size_ - backup_count_);
+    backup_count_ += count;
+    byte_count_ -= count;
+}
+
+bool IOBufferInputStream::Skip(int count)
+{
+    const void* data;
+    int size;
+    while(count > 0) {
+        if(! Next(&data, &size)) {
+            return false;
+        }
+        if(size > count) {
+            BackUp(size - count);
+            return true;
+        }
+        count -= size;
+    }
+    return true;
+}
+
+IOBufferOutputStream::IOBufferOutputStream(IOBuffer* buf)
+    : buf_(buf),
+      byte_count_(0)
+{
+}
+
+IOBufferOutputStream::~IOBufferOutputStream()
+{
+    // AppendSpace() does not check: only what was written counts.
+    buf_->CheckWatermarks();
+}
+
+bool IOBufferOutputStream::Next(void** data, int* size)
+{
+    *data = buf_->AppendSpace(size);
+    byte_count_ += *size;
+    return true;
+}
+
+void IOBufferOutputStream::BackUp(int count)
+{
+    assert(count >= 0 && count <= buf_->BytesConsumable());
+    buf_->Trim(buf_->BytesConsumable() - count);
+    byte_count_ -= count;
+}
+
+} // namespace paxoslease
@@ -0,0 +1,62 @@
+#ifndef PAXOSLEASE_IO_BUFFER_STREAM_H
+#define PAXOSLEASE_IO_BUFFER_STREAM_H
+
+#include <stdint.h>
+
+#include <google/protobuf/io/zero_copy_stream.h>
+
+#include "io_buffer.h"
+
+namespace paxoslease {
+
+/// A ZeroCopyInputStream over the IOBufferData blocks of an IOBuffer. Each
+/// call to Next() hands out the consumable bytes of one block, so protobuf
+/// can parse data spanning block boundaries without flattening the buffer.
+///
+/// Note: the stream never consumes the IOBuffer, and the IOBuffer must not
+/// be modified while the stream is in use.
+class IOBufferInputStream : public google::protobuf::io::ZeroCopyInputStream {
+public:
+    explicit IOBufferInputStream(const IOBuffer* buf);
+    virtual ~IOBufferInputStream();
+
+    virtual bool Next(const void** data, int* size);
+    virtual void BackUp(int count);
+    virtual bool Skip(int count);
+    virtual int64_t ByteCount() const { return byte_count_; }
+
+private:
+    IOBuffer::SegmentIterator it_;
+
+    const char* last_data_;
+    int last_size_;
+    int backup_count_;
+    int64_t byte_count_;
+
+    IOBufferInputStream(const IOBufferInputStream&);
+    IOBufferInputStream& operator =(const IOBufferInputStream&);
+};
+
+/// A ZeroCopyOutputStream that serializes into an IOBuffer. Next() hands
+/// out the free space at the tail of the last IOBufferData, appending fresh
+/// blocks as they fill up, and BackUp() trims what was not written.
+class IOBufferOutputStream : public google::protobuf::io::ZeroCopyOutputStream {
+public:
+    explicit IOBufferOutputStream(IOBuffer* buf);
+    virtual ~IOBufferOutputStream();
+
+    virtual bool Next(void** data, int* size);
+    virtual void BackUp(int count);
+    virtual int64_t ByteCount() const { return byte_count_; }
+
+private:
+    IOBuffer* buf_;
+    int64_t byte_count_;
+
+    IOBufferOutputStream(const IOBufferOutputStream&);
+    IOBufferOutputStream& operator =(const IOBufferOutputStream&);
+};
+
+} // namespace paxoslease
+
+#endif //PAXOSLEASE_IO_BUFFER_STREAM_H
@@ -0,0 +1,80 @@
+#include "message_pool.h"
+
+#include <algorithm>
+
+#include "message_registry.h"
+
+namespace paxoslease {
+
+void MessageDeleter::operator ()(google::protobuf::Message* message) const
+{
+    if(pool_) {
+        pool_->Release(message);
+    } else {
+        delete message;
+    }
+}
+
+MessagePool::MessagePool(size_t max_free_per_type)
+    : free_lists_(MessageRegistry::Instance().size()),
+      max_free_per_type_(max_free_per_type),
+      hits_(0),
+      misses_(0)
+{
+}
+
+MessagePool::~MessagePool()
+{
+    std::vector<FreeList>::iterator it;
+    for(it = free_lists_.begin(); it != free_lists_.end(); it++) {
+        for(size_t i = 0; i < it->size(); i++) {
+            delete (*it)[i];
+        }
+    }
+}
+
+MessagePtr MessagePool::Acquire(const google::protobuf::Message* prototype)
+{
+    const int type_id = MessageRegistry::Instance().TypeId(prototype->GetDescriptor());
+    if(type_id == MessageRegistry::kInvalidTypeId) {
+        misses_++;
+        return MessagePtr(prototype->New(), MessageDeleter());
+    }
+
+    FreeList& free_list = free_lists_[type_id];
+    if(free_list.empty()) {
+        misses_++;
+        return MessagePtr(prototype->New(), MessageDeleter(this));
+    }
+
+    hits_++;
+    google::protobuf::Message* message = free_list.back();
+    free_list.pop_back();
+    return MessagePtr(message, MessageDeleter(this));
+}
+
+void MessagePool::Release(google::protobuf::Message* message)
+{
+    if(! message) {
+        return;
+    }
+
+    const int type_id = MessageRegistry::Instance().TypeId(message->GetDescriptor());
+    if(type_id == MessageRegistry::kInvalidTypeId) {
+        delete message;
+        return;
+    }
+
+    FreeList& free_list = free_lists_[type_id];
+    if(free_list.size() >= max_free_per_type_) {
+        delete message;
+        return;
+    }
+    if(free_list.capacity() == 0) {
+        free_list.reserve(std::min(max_free_per_type_, size_t(64)));
+    }
+    message->Clear();
+    free_list.push_back(message);
+}
+
+} // namespace paxoslease
@@ -0,0 +1,67 @@
+#ifndef PAXOSLEASE_MESSAGE_POOL_H
+#define PAXOSLEASE_MESSAGE_POOL_H
+
+#include <stddef.h>
+#include <memory>
+#include <vector>
+
+#include "message.pb.h"
+
+namespace paxoslease {
+
+class MessagePool;
+
+/// Hands a message back to the pool it came from, or deletes it when it
+/// was allocated without one.
+class MessageDeleter {
+public:
+    MessageDeleter() : pool_(0) {}
+    explicit MessageDeleter(MessagePool* pool) : pool_(pool) {}
+
+    void operator ()(google::protobuf::Message* message) const;
+
+    MessagePool* pool() const { return pool_; }
+
+private:
+    MessagePool* pool_;
+};
+
+typedef std::unique_ptr<google::protobuf::Message, MessageDeleter> MessagePtr;
+
+/// Per-type free lists of messages, indexed by MessageRegistry type id, so
+/// that under steady traffic decoding reuses released messages instead of
+/// allocating new ones. Messages outside the registry are allocated and
+/// deleted as usual.
+///
+/// Note: a pool is not thread safe, it belongs to one event loop, and it
+/// must outlive every MessagePtr acquired from it.
+class MessagePool {
+public:
+    explicit MessagePool(size_t max_free_per_type = 1024);
+    ~MessagePool();
+
+    /// Get a cleared message of the same type as prototype.
+    MessagePtr Acquire(const google::protobuf::Message* prototype);
+
+    /// Called by MessageDeleter. The message is cleared and kept for reuse
+    /// unless the free list of its type is full.
+    void Release(google::protobuf::Message* message);
+
+    size_t hits() const { return hits_; }
+    size_t misses() const { return misses_; }
+
+private:
+    typedef std::vector<google::protobuf::Message*> FreeList;
+
+    std::vector<FreeList> free_lists_;
+    size_t max_free_per_type_;
+    size_t hits_;
+    size_t misses_;
+
+    MessagePool(const MessagePool&);
+    MessagePool& operator =(const MessagePool&);
+};
+
+} // namespace paxoslease
+
+#endif //PAXOSLEASE_MESSAGE_POOL_H
@@ -0,0 +1,79 @@
+#ifndef PAXOSLEASE_MESSAGE_REGISTRY_H
+#define PAXOSLEASE_MESSAGE_REGISTRY_H
+
+#include <vector>
+
+#include "message.pb.h"
+
+namespace paxoslease {
+
+/// Assigns every top level message declared in message.proto a small type
+/// id, used on the wire in place of the type name. Ids follow declaration
+/// order starting from 1, so new messages must be appended to message.proto
+/// to keep the ids of existing ones stable. 0 is never a valid id.
+class MessageRegistry {
+public:
+    static const int kInvalidTypeId = 0;
+
+    static const MessageRegistry& Instance()
+    {
+        static const MessageRegistry registry;
+        return registry;
+    }
+
+    /// O(1): the id is the declaration index of descriptor in message.proto.
+    int TypeId(const google::protobuf::Descriptor* descriptor) const
+    {
+        if(descriptor->file() != file_ || descriptor->containing_type() != NULL)
+        {
+            return kInvalidTypeId;
+        }
+        return descriptor->index() + 1;
+    }
+
+    int TypeId(const google::protobuf::Message& message) const
+    {
+        return TypeId(message.GetDescriptor());
+    }
+
+    /// O(1) lookup of the default instance for type_id, NULL if unknown.
+    const google::protobuf::Message* Prototype(int type_id) const
+    {
+        if(type_id <= kInvalidTypeId || type_id >= static_cast<int>(prototypes_.size()))
+        {
+            return NULL;
+        }
+        return prototypes_[type_id];
+    }
+
+    google::protobuf::Message* NewMessage(int type_id) const
+    {
+        const google::protobuf::Message* prototype = Prototype(type_id);
+        return prototype ? prototype->New() : NULL;
+    }
+
+    /// One more than the largest valid type id.
+    int size() const { return static_cast<int>(prototypes_.size()); }
+
+private:
+    MessageRegistry()
+        : file_(PrepareRequest::descriptor()->file())
+    {
+        prototypes_.resize(file_->message_type_count() + 1, NULL);
+        for(int i = 0; i < file_->message_type_count(); i++)
+        {
+            prototypes_[i + 1] = google::protobuf::MessageFactory::generated_factory()
+                ->GetPrototype(file_->message_type(i));
+        }
+    }
+
+    const google::protobuf::FileDescriptor* file_;
+    std::vector<const google::protobuf::Message*> prototypes_;
+
+    MessageRegistry(const MessageRegistry&);
+    MessageRegistry& operator =(const MessageRegistry&);
+};
+
+} // namespace paxoslease
+
+#endif //PAXOSLEASE_MESSAGE_REGISTRY_H
@@ -1,10 +1,18 @@
 #include <iostream>
 #include <functional>
 #include <string>
+#include <vector>
+#include <algorithm>
 
 #include "message.pb.h"
 #include "dispatcher.h"
 #include "codec.h"
+#include "datagram_packer.h"
+#include "frame_decoder.h"
+#include "io_buffer.h"
+#include "slab_io_buffer_allocator.h"
+#include "sharded_dispatcher.h"
+#include "static_dispatcher.h"
 
 using namespace std;
 
@@ -16,10 +24,26 @@ public:
         cout << "ballot_number:" << prepare_request->ballot_number() << endl;
         cout << "node_id:" << prepare_request->node_id() << endl;
     }
+    void OnPrepareRequests(const vector<paxoslease::PrepareRequest*>& prepare_requests)
+    {
+        cout << "OnPrepareRequests:" << prepare_requests.size() << endl;
+        for(size_t i = 0; i < prepare_requests.size(); i++)
+        {
+            cout << "ballot_number:" << prepare_requests[i]->ballot_number() << endl;
+        }
+    }
 };
 
 class Acceptor {
 public:
+    void OnMessage(paxoslease::PrepareRequest& prepare_request)
+    {
+        cout << "OnMessage:" << prepare_request.GetTypeName() << endl;
+    }
+    void OnMessage(paxoslease::ProposeRequest& propose_request)
+    {
+        cout << "OnMessage:" << propose_request.GetTypeName() << endl;
+    }
     void OnPrepareResponse(paxoslease::PrepareResponse* prepare_response)
     {
         cout << "OnPrepareResponse:" << prepare_response->GetTypeName() << endl; 
@@ -35,6 +59,9 @@ void OnProposeRequest(paxoslease::ProposeRequest* propose_request)
 
 int main()
 {
+    paxoslease::SlabIOBufferAllocator* allocator = new paxoslease::SlabIOBufferAllocator();
+    paxoslease::SetIOBufferAllocator(allocator);
+
     cout << "test dispatcher" << endl << endl;
     paxoslease::ProtobufDispatcher dispatcher;
     Proposer proposer;
@@ -70,20 +97,186 @@ int main()
     q_r.set_node_id(1);
 
     string p_q_msg = Encode(p_q);
-    google::protobuf::Message* message = Decode(p_q_msg);
-    dispatcher.OnMessage(message);
+    paxoslease::MessagePool pool;
+    paxoslease::MessagePtr message = Decode(p_q_msg, &pool);
+    dispatcher.OnMessage(message.get());
     
     string p_r_msg = Encode(p_r);
-    message = Decode(p_r_msg);
-    dispatcher.OnMessage(message);
+    message = Decode(p_r_msg, &pool);
+    dispatcher.OnMessage(message.get());
 
     string q_q_msg = Encode(p_r);
-    message = Decode(q_q_msg);
-    dispatcher.OnMessage(message);
+    message = Decode(q_q_msg, &pool);
+    dispatcher.OnMessage(message.get());
    
     string q_r_msg = Encode(q_r);
-    message = Decode(q_r_msg);
-    dispatcher.OnMessage(message);
+    message = Decode(q_r_msg, &pool);
+    dispatcher.OnMessage(message.get());
+
+    cout << "test codec from IOBuffer" << endl << endl;
+
+    // split the frame over two blocks
+    paxoslease::IOBuffer io_buf, io_buf_tail;
+    io_buf.CopyIn(p_q_msg.data(), 10);
+    io_buf_tail.CopyIn(p_q_msg.data() + 10, p_q_msg.size() - 10);
+    io_buf.Append(&io_buf_tail);
+    message = Decode(io_buf, &pool);
+    dispatcher.OnMessage(message.get());
+
+    cout << "test codec into IOBuffer" << endl << endl;
+
+    paxoslease::IOBuffer out_buf;
+    Encode(p_r, &out_buf);
+    message = Decode(out_buf, &pool);
+    dispatcher.OnMessage(message.get());
+
+    cout << "test codec with type id" << endl << endl;
+
+    string p_q_id_msg = Encode(p_q, kFrameTypeId);
+    cout << "type name frame:" << p_q_msg.size() << " type id frame:" << p_q_id_msg.size() << endl;
+    message = Decode(p_q_id_msg, &pool);
+    dispatcher.OnMessage(message.get());
+
+    cout << "test fixed codec" << endl << endl;
+
+    char fixed_msg[64];
+    int fixed_size = EncodeFixed(p_r, fixed_msg);
+    cout << "fixed frame:" << fixed_size << endl;
+    paxoslease::PrepareResponse fixed_p_r;
+    if(DecodeFixed(fixed_msg, fixed_size, &fixed_p_r))
+    {
+        dispatcher.OnMessage(&fixed_p_r);
+    }
+    message = Decode(Encode(q_q, kFrameFixed), &pool);
+    dispatcher.OnMessage(message.get());
+
+    cout << "test codec with checksum" << endl << endl;
+
+    string crc_msg = Encode(p_q, kFrameTypeId, true);
+    message = Decode(crc_msg, &pool);
+    dispatcher.OnMessage(message.get());
+    crc_msg[crc_msg.size() / 2] ^= 0x01;
+    message = Decode(crc_msg, &pool);
+    cout << "corrupted frame " << (message ? "accepted" : "rejected") << endl;
+    message.reset();
+
+    cout << "test frame decoder" << endl << endl;
+
+    // three frames arriving in 5 byte pieces
+    string stream_msg = p_q_msg + Encode(p_r, kFrameTypeId) + Encode(q_r, kFrameTypeId);
+    paxoslease::FrameDecoder frame_decoder(&pool);
+    vector<paxoslease::MessagePtr> messages;
+    for(size_t i = 0; i < stream_msg.size(); i += 5)
+    {
+        paxoslease::IOBuffer piece;
+        piece.CopyIn(stream_msg.data() + i, min(stream_msg.size() - i, size_t(5)));
+        frame_decoder.Decode(&piece, &messages);
+    }
+    cout << "decoded:" << messages.size() << " buffered:" << frame_decoder.BytesBuffered() << endl;
+    for(size_t i = 0; i < messages.size(); i++)
+    {
+        dispatcher.OnMessage(messages[i].get());
+    }
+
+    cout << "test datagram packer" << endl << endl;
+
+    // four frames fill the mtu exactly: the fifth sends them, Flush() the
+    // last two. Broadcasts come back to the socket itself.
+    paxoslease::UdpSocket udp_socket(34567);
+    if(udp_socket.Open() == 0)
+    {
+        paxoslease::PrepareRequest d_q(p_q);
+        d_q.set_ballot_number(1000);
+        paxoslease::DatagramPacker packer(&udp_socket, 4 * Encode(d_q, kFrameTypeId).size());
+        bool sent = true;
+        for(int i = 0; i < 6; i++)
+        {
+            d_q.set_ballot_number(1000 + i);
+            sent = packer.Broadcast(d_q) == 0 && sent;
+        }
+        cout << "frames pending:" << packer.FramesPending() << endl;
+        sent = packer.Flush() > 0 && sent;
+        vector<paxoslease::MessagePtr> unpacked;
+        for(int i = 0; sent && i < 2; i++)
+        {
+            paxoslease::IOBuffer datagram;
+            sockaddr_in addr;
+            int addr_len = sizeof(addr);
+            udp_socket.Recv(&datagram, 64 << 10, &addr, &addr_len);
+            cout << "datagram:" << datagram.BytesConsumable()
+                << " frames:" << paxoslease::UnpackDatagram(datagram, &pool, &unpacked) << endl;
+        }
+        for(size_t i = 0; i < unpacked.size(); i++)
+        {
+            cout << "ballot_number:"
+                << static_cast<paxoslease::PrepareRequest*>(unpacked[i].get())->ballot_number() << endl;
+        }
+    }
+
+    // a frame of unknown type is skipped, the frames around it still come out.
+    {
+        string frame = Encode(p_q, kFrameTypeId);
+        string unknown = frame;
+        unknown[kHeadLengthSpace] = 0x7f;
+        paxoslease::IOBuffer datagram;
+        datagram.CopyIn(frame.data(), frame.size());
+        datagram.CopyIn(unknown.data(), unknown.size());
+        datagram.CopyIn(frame.data(), frame.size());
+        vector<paxoslease::MessagePtr> unpacked;
+        int dropped = 0;
+        cout << "frames:" << paxoslease::UnpackDatagram(datagram, &pool, &unpacked, &dropped)
+            << " dropped:" << dropped << endl;
+    }
+
+    cout << "test batch dispatcher" << endl << endl;
+
+    dispatcher.RegisterBatchCallback<paxoslease::PrepareRequest>(std::bind(&Proposer::OnPrepareRequests, &proposer, std::placeholders::_1));
+    messages.push_back(Decode(p_q_id_msg, &pool));
+    dispatcher.OnMessages(messages);
+    messages.clear();
+
+    cout << "test sharded dispatcher" << endl << endl;
+
+    // the callbacks print, so one shard keeps the output readable.
+    paxoslease::ShardedDispatcher sharded(dispatcher, 1);
+    sharded.Start();
+    message = Decode(p_r_msg, &pool);
+    sharded.Dispatch(message);
+    sharded.Stop();
+
+    cout << "test dispatch stats" << endl << endl;
+
+    paxoslease::DispatchStats stats(1);
+    dispatcher.SetStats(&stats);
+    message = Decode(p_q_id_msg, &pool);
+    dispatcher.OnMessage(message.get(), p_q_id_msg.size());
+    dispatcher.OnMessage(&q_q);
+    dispatcher.SetStats(NULL);
+    cout << stats.ToString();
+
+    cout << "test static dispatcher" << endl << endl;
+
+    paxoslease::StaticDispatcher<Acceptor, paxoslease::PrepareRequest, paxoslease::ProposeRequest>
+        static_dispatcher(&acceptor);
+    string frames = Encode(p_q) + Encode(q_q, kFrameFixed) + Encode(p_q, kFrameTypeId, true);
+    cout << "static dispatched:" << static_dispatcher.DispatchAll(frames.data(), frames.size()) << endl;
+    cout << "other type:" << static_dispatcher.Dispatch(Encode(p_r, kFrameTypeId)) << endl;
+
+    cout << "test priority lanes" << endl << endl;
+
+    // renewals (ballot 333 here) overtake the prepare requests posted first.
+    dispatcher.SetLane<paxoslease::ProposeRequest>(2);
+    dispatcher.SetLane<paxoslease::PrepareResponse>(1,
+            [](const paxoslease::PrepareResponse& m) { return !m.lease_empty(); });
+    dispatcher.Post(Decode(p_q_msg, &pool));
+    dispatcher.Post(Decode(p_r_msg, &pool));
+    dispatcher.Post(Decode(Encode(q_q), &pool));
+    cout << "lanes pending:" << dispatcher.Pending() << endl;
+    cout << "drained:" << dispatcher.Drain() << endl;
+
+    cout << "pool hits:" << pool.hits() << " misses:" << pool.misses() << endl;
+    cout << "io buffer blocks hits:" << allocator->hits() << " misses:" << allocator->misses()
+        << " outstanding:" << allocator->outstanding() << endl;
 
     return 0; 
 }
@@ -0,0 +1,168 @@
+#include "sharded_dispatcher.h"
+
+#include <assert.h>
+#include <chrono>
+
+#include "message.pb.h"
+
+namespace paxoslease {
+
+template <typename T>
+static uint64_t NodeIdOf(const T& message)
+{
+    return static_cast<uint32_t>(message.node_id());
+}
+
+ShardedDispatcher::ShardedDispatcher(const ProtobufDispatcher& dispatcher, int num_shards,
+        size_t queue_capacity)
+    : dispatcher_(dispatcher),
+      shards_(),
+      routing_keys_(MessageRegistry::Instance().size()),
+      running_(false)
+{
+    assert(num_shards > 0);
+    for(int i = 0; i < num_shards; i++) {
+        shards_.push_back(std::unique_ptr<Shard>(new Shard(queue_capacity)));
+    }
+
+    // the default key is the node_id field. Look it up once per type rather
+    // than by name for every message dispatched...
+    const MessageRegistry& registry = MessageRegistry::Instance();
+    for(int type_id = 1; type_id < registry.size(); type_id++) {
+        const google::protobuf::Message* prototype = registry.Prototype(type_id);
+        const google::protobuf::FieldDescriptor* field = (prototype ?
+                prototype->GetDescriptor()->FindFieldByName("node_id") : NULL);
+        if(field && field->cpp_type() == google::protobuf::FieldDescriptor::CPPTYPE_INT32) {
+            routing_keys_[type_id] = [field](const google::protobuf::Message& message) {
+                return uint64_t(static_cast<uint32_t>(
+                            message.GetReflection()->GetInt32(message, field)));
+            };
+        }
+    }
+    // ...and skip reflection altogether for the lease messages.
+    SetRoutingKey<PrepareRequest>(&NodeIdOf<PrepareRequest>);
+    SetRoutingKey<PrepareResponse>(&NodeIdOf<PrepareResponse>);
+    SetRoutingKey<ProposeRequest>(&NodeIdOf<ProposeRequest>);
+    SetRoutingKey<ProposeResponse>(&NodeIdOf<ProposeResponse>);
+}
+
+ShardedDispatcher::~ShardedDispatcher()
+{
+    Stop();
+}
+
+void ShardedDispatcher::Start()
+{
+    if(running_.exchange(true)) {
+        return;
+    }
+    for(size_t i = 0; i < shards_.size(); i++) {
+        shards_[i]->exited.store(false, std::memory_order_relaxed);
+        shards_[i]->thread = std::thread(&ShardedDispatcher::Run, this, shards_[i].get());
+    }
+}
+
+void ShardedDispatcher::Stop()
+{
+    if(! running_.exchange(false)) {
+        return;
+    }
+    for(size_t i = 0; i < shards_.size(); i++) {
+        Shard* shard = shards_[i].get();
+        // a worker may wait on a full done ring, even with its queue
+        // empty, to hand back the last message it popped: reap until it
+        // is really gone.
+        while(shard->thread.joinable() && ! shard->exited.load(std::memory_order_acquire)) {
+            Reap();
+            std::this_thread::yield();
+        }
+    }
+    for(size_t i = 0; i < shards_.size(); i++) {
+        if(shards_[i]->thread.joinable()) {
+            shards_[i]->thread.join();
+        }
+    }
+    Reap();
+}
+
+int ShardedDispatcher::ShardOf(uint64_t key) const
+{
+    // mix the key so that consecutive ids spread evenly.
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return static_cast<int>(key % shards_.size());
+}
+
+uint64_t ShardedDispatcher::KeyOf(const google::protobuf::Message& message) const
+{
+    const size_t type_id = MessageRegistry::Instance().TypeId(message.GetDescriptor());
+    if(type_id < routing_keys_.size() && routing_keys_[type_id]) {
+        return routing_keys_[type_id](message);
+    }
+    return 0; // no node_id: all on one worker
+}
+
+bool ShardedDispatcher::Dispatch(MessagePtr& message)
+{
+    if(! message) {
+        return true;
+    }
+    Shard* shard = shards_[ShardOf(KeyOf(*message))].get();
+    if(shard->queue.TryPush(std::move(message))) {
+        return true;
+    }
+    // the worker may be blocked on returning messages: reap and retry once.
+    Reap();
+    return shard->queue.TryPush(std::move(message));
+}
+
+size_t ShardedDispatcher::Reap()
+{
+    size_t nreaped = 0;
+    MessagePtr message;
+    for(size_t i = 0; i < shards_.size(); i++) {
+        while(shards_[i]->done.TryPop(&message)) {
+            message.reset();
+            nreaped++;
+        }
+    }
+    return nreaped;
+}
+
+void ShardedDispatcher::Run(Shard* shard)
+{
+    const int kSpins = 64;
+    const int kYields = 1024;
+
+    MessagePtr message;
+    int idle = 0;
+    while(true) {
+        if(! shard->queue.TryPop(&message)) {
+            if(! running_.load(std::memory_order_acquire) && shard->queue.IsEmpty()) {
+                break;
+            }
+            idle++;
+            if(idle > kSpins + kYields) {
+                std::this_thread::sleep_for(std::chrono::microseconds(50));
+            } else if(idle > kSpins) {
+                std::this_thread::yield();
+            }
+            continue;
+        }
+        idle = 0;
+
+        dispatcher_.OnMessage(message.get());
+
+        if(! message.get_deleter().pool()) {
+            message.reset(); // a heap message can be freed right here.
+            continue;
+        }
+        while(! shard->done.TryPush(std::move(message))) {
+            std::this_thread::yield();
+        }
+    }
+    shard->exited.store(true, std::memory_order_release);
+}
+
+} // namespace paxoslease
@@ -0,0 +1,99 @@
+#ifndef PAXOSLEASE_SHARDED_DISPATCHER_H
+#define PAXOSLEASE_SHARDED_DISPATCHER_H
+
+#include <stdint.h>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "dispatcher.h"
+#include "message_pool.h"
+#include "message_registry.h"
+#include "spsc_ring.h"
+
+namespace paxoslease {
+
+/// Spreads dispatch over N worker threads. Each message is routed by a key
+/// (by default its node_id field) to one worker, through a lock-free SPSC
+/// ring, and the worker runs it through the callbacks of a ProtobufDispatcher.
+/// Messages with the same key always land on the same worker, so they are
+/// handled in the order they were dispatched.
+///
+/// Dispatch() and Reap() must be called from one thread, normally the event
+/// loop that decodes the messages. Messages from a MessagePool are sent back
+/// to that thread once handled and are released by Reap(), so the pool is
+/// never touched by the workers.
+///
+/// Note: callbacks run concurrently on different workers; state they share
+/// across keys needs its own synchronization.
+class ShardedDispatcher {
+public:
+    typedef std::function<uint64_t(const google::protobuf::Message& message)> RoutingKey;
+
+    ShardedDispatcher(const ProtobufDispatcher& dispatcher, int num_shards,
+            size_t queue_capacity = 4096);
+    ~ShardedDispatcher();
+
+    /// Route messages of type T by key instead of by node_id. Must be set
+    /// before Start().
+    template <typename T>
+    void SetRoutingKey(const std::function<uint64_t(const T& message)>& key)
+    {
+        const int type_id = MessageRegistry::Instance().TypeId(T::descriptor());
+        if(type_id != MessageRegistry::kInvalidTypeId) {
+            routing_keys_[type_id] = [key](const google::protobuf::Message& message) {
+                return key(static_cast<const T&>(message));
+            };
+        }
+    }
+
+    void Start();
+
+    /// Handle everything already dispatched, then join the workers.
+    void Stop();
+
+    /// Queue message on the worker of its key. Returns false, leaving the
+    /// message with the caller, if that worker's queue is full.
+    bool Dispatch(MessagePtr& message);
+
+    /// Release the messages the workers are done with. Returns their #.
+    size_t Reap();
+
+    int num_shards() const { return static_cast<int>(shards_.size()); }
+
+    /// Which worker messages with key go to.
+    int ShardOf(uint64_t key) const;
+
+private:
+    struct Shard {
+        explicit Shard(size_t capacity)
+            : queue(capacity),
+              done(capacity),
+              exited(false)
+        {
+        }
+
+        SpscRing<MessagePtr> queue; // dispatching thread -> worker
+        SpscRing<MessagePtr> done;  // worker -> dispatching thread
+        std::thread thread;
+        std::atomic<bool> exited;   // set by the worker as Run() returns
+    };
+
+    uint64_t KeyOf(const google::protobuf::Message& message) const;
+
+    void Run(Shard* shard);
+
+    const ProtobufDispatcher& dispatcher_;
+    std::vector<std::unique_ptr<Shard> > shards_;
+    std::vector<RoutingKey> routing_keys_; // by type id
+    std::atomic<bool> running_;
+
+    ShardedDispatcher(const ShardedDispatcher&);
+    ShardedDispatcher& operator =(const ShardedDispatcher&);
+};
+
+} // namespace paxoslease
+
+#endif //PAXOSLEASE_SHARDED_DISPATCHER_H
@@ -0,0 +1,321 @@
+#include "slab_io_buffer_allocator.h"
+
+#include <assert.h>
+#include <utility>
+
+namespace paxoslease {
+
+/// One thread's magazines. Counters are written by the owning thread only,
+/// with plain relaxed stores, and read by anyone.
+///
+/// Whoever is last to let go of a cache frees it: the allocator for a cache
+/// no thread holds, the thread for a cache its allocator was destroyed
+/// under.
+struct SlabIOBufferAllocator::ThreadCache {
+    enum State {
+        kFree,      // owned by the allocator, for the next thread to take
+        kInUse,     // held by a thread
+        kOrphaned   // held by a thread, the allocator is gone
+    };
+
+    ThreadCache()
+        : loaded(0),
+          previous(0),
+          state(kInUse),
+          hits(0),
+          misses(0),
+          frees(0),
+          next(0)
+    {
+    }
+
+    ~ThreadCache()
+    {
+        SlabIOBufferAllocator::Free(loaded);
+        SlabIOBufferAllocator::Free(previous);
+    }
+
+    Magazine* loaded;
+    Magazine* previous;
+    std::atomic<int> state; // caches of exited threads are reused
+
+    std::atomic<uint64_t> hits;
+    std::atomic<uint64_t> misses;
+    std::atomic<uint64_t> frees;
+
+    ThreadCache* next;
+};
+
+static inline void Bump(std::atomic<uint64_t>* counter)
+{
+    counter->store(counter->load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+/// The caches of the calling thread, handed back when it exits. They are
+/// known by allocator id, not address: a new allocator may take the place
+/// of a destroyed one.
+struct SlabThreadCaches {
+    SlabThreadCaches() : count(0) {}
+
+    ~SlabThreadCaches()
+    {
+        for(int i = 0; i < count; i++) {
+            SlabIOBufferAllocator::ReleaseCache(caches[i]);
+        }
+    }
+
+    // forget the caches of allocators destroyed meanwhile.
+    void DropOrphans()
+    {
+        int n = 0;
+        for(int i = 0; i < count; i++) {
+            if(caches[i]->state.load(std::memory_order_acquire) ==
+                    SlabIOBufferAllocator::ThreadCache::kOrphaned) {
+                delete caches[i];
+            } else {
+                ids[n] = ids[i];
+                caches[n] = caches[i];
+                n++;
+            }
+        }
+        count = n;
+    }
+
+    int count;
+    uint64_t ids[SlabIOBufferAllocator::kMaxThreadCaches];
+    SlabIOBufferAllocator::ThreadCache* caches[SlabIOBufferAllocator::kMaxThreadCaches];
+};
+
+static thread_local SlabThreadCaches t_caches;
+
+static std::atomic<uint64_t> s_next_allocator_id(1);
+
+SlabIOBufferAllocator::SlabIOBufferAllocator(size_t buffer_size)
+    : buffer_size_(buffer_size),
+      id_(s_next_allocator_id.fetch_add(1, std::memory_order_relaxed)),
+      caches_(0),
+      uncached_allocs_(0),
+      uncached_frees_(0)
+{
+    for(int i = 0; i < kDepotSlots; i++) {
+        full_[i].store(0, std::memory_order_relaxed);
+        empty_[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+SlabIOBufferAllocator::~SlabIOBufferAllocator()
+{
+    for(int i = 0; i < kDepotSlots; i++) {
+        Free(full_[i].exchange(0));
+        Free(empty_[i].exchange(0));
+    }
+    // a cache some thread still holds is left to it: its thread_local
+    // registry points to it until the thread exits or looks again.
+    ThreadCache* cache = caches_.load(std::memory_order_acquire);
+    while(cache) {
+        ThreadCache* next = cache->next;
+        int state = ThreadCache::kInUse;
+        if(! cache->state.compare_exchange_strong(state, ThreadCache::kOrphaned,
+                    std::memory_order_acq_rel)) {
+            delete cache;
+        }
+        cache = next;
+    }
+}
+
+SlabIOBufferAllocator::ThreadCache* SlabIOBufferAllocator::Cache()
+{
+    SlabThreadCaches& local = t_caches;
+    for(int i = 0; i < local.count; i++) {
+        if(local.ids[i] == id_) {
+            return local.caches[i];
+        }
+    }
+    if(local.count == kMaxThreadCaches) {
+        local.DropOrphans();
+        if(local.count == kMaxThreadCaches) {
+            return NULL;
+        }
+    }
+
+    // take over the cache of an exited thread, or link a new one.
+    ThreadCache* cache = caches_.load(std::memory_order_acquire);
+    for(; cache; cache = cache->next) {
+        int state = ThreadCache::kFree;
+        if(cache->state.compare_exchange_strong(state, ThreadCache::kInUse,
+                    std::memory_order_acquire)) {
+            break;
+        }
+    }
+    if(! cache) {
+        cache = new ThreadCache();
+        cache->loaded = new Magazine();
+        cache->previous = new Magazine();
+        cache->next = caches_.load(std::memory_order_relaxed);
+        while(! caches_.compare_exchange_weak(cache->next, cache, std::memory_order_release)) {
+        }
+    }
+
+    local.ids[local.count] = id_;
+    local.caches[local.count] = cache;
+    local.count++;
+    return cache;
+}
+
+void SlabIOBufferAllocator::ReleaseCache(ThreadCache* cache)
+{
+    // keep the magazines with the cache, the next thread taking it over
+    // starts warm; the depot has no room reserved for them anyway. If the
+    // allocator is gone, nobody will: free it all.
+    int state = ThreadCache::kInUse;
+    if(! cache->state.compare_exchange_strong(state, ThreadCache::kFree,
+                std::memory_order_acq_rel)) {
+        delete cache;
+    }
+}
+
+SlabIOBufferAllocator::Magazine* SlabIOBufferAllocator::Take(std::atomic<Magazine*>* slots)
+{
+    for(int i = 0; i < kDepotSlots; i++) {
+        if(slots[i].load(std::memory_order_relaxed)) {
+            Magazine* magazine = slots[i].exchange(0, std::memory_order_acquire);
+            if(magazine) {
+                return magazine;
+            }
+        }
+    }
+    return NULL;
+}
+
+bool SlabIOBufferAllocator::Put(std::atomic<Magazine*>* slots, Magazine* magazine)
+{
+    for(int i = 0; i < kDepotSlots; i++) {
+        Magazine* expected = 0;
+        if(! slots[i].load(std::memory_order_relaxed) &&
+                slots[i].compare_exchange_strong(expected, magazine, std::memory_order_release)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void SlabIOBufferAllocator::Free(Magazine* magazine)
+{
+    if(! magazine) {
+        return;
+    }
+    for(int i = 0; i < magazine->count; i++) {
+        delete [] magazine->blocks[i];
+    }
+    delete magazine;
+}
+
+char* SlabIOBufferAllocator::Allocate()
+{
+    ThreadCache* cache = Cache();
+    if(! cache) {
+        uncached_allocs_.fetch_add(1, std::memory_order_relaxed);
+        return new char[buffer_size_];
+    }
+
+    Magazine* loaded = cache->loaded;
+    if(loaded->count > 0) {
+        Bump(&cache->hits);
+        return loaded->blocks[--loaded->count];
+    }
+    return Refill(cache);
+}
+
+// the loaded magazine is empty.
+char* SlabIOBufferAllocator::Refill(ThreadCache* cache)
+{
+    if(cache->previous->count > 0) {
+        std::swap(cache->loaded, cache->previous);
+    } else {
+        Magazine* full = Take(full_);
+        if(! full) {
+            Bump(&cache->misses);
+            return new char[buffer_size_];
+        }
+        if(! Put(empty_, cache->previous)) {
+            delete cache->previous;
+        }
+        cache->previous = cache->loaded;
+        cache->loaded = full;
+    }
+
+    Bump(&cache->hits);
+    Magazine* loaded = cache->loaded;
+    assert(loaded->count > 0);
+    return loaded->blocks[--loaded->count];
+}
+
+void SlabIOBufferAllocator::Deallocate(char* buf)
+{
+    ThreadCache* cache = Cache();
+    if(! cache) {
+        uncached_frees_.fetch_add(1, std::memory_order_relaxed);
+        delete [] buf;
+        return;
+    }
+
+    Bump(&cache->frees);
+    Magazine* loaded = cache->loaded;
+    if(loaded->count < kMagazineSize) {
+        loaded->blocks[loaded->count++] = buf;
+        return;
+    }
+    Spill(cache, buf);
+}
+
+// the loaded magazine is full.
+void SlabIOBufferAllocator::Spill(ThreadCache* cache, char* buf)
+{
+    if(cache->previous->count < kMagazineSize) {
+        std::swap(cache->loaded, cache->previous);
+    } else {
+        // both full: hand one to the depot, or free it if there is no room.
+        Magazine* empty = Take(empty_);
+        if(! Put(full_, cache->previous)) {
+            Free(cache->previous);
+        }
+        cache->previous = cache->loaded;
+        cache->loaded = empty ? empty : new Magazine();
+    }
+
+    Magazine* loaded = cache->loaded;
+    assert(loaded->count < kMagazineSize);
+    loaded->blocks[loaded->count++] = buf;
+}
+
+uint64_t SlabIOBufferAllocator::hits() const
+{
+    uint64_t nhits = 0;
+    for(ThreadCache* cache = caches_.load(std::memory_order_acquire); cache; cache = cache->next) {
+        nhits += cache->hits.load(std::memory_order_relaxed);
+    }
+    return nhits;
+}
+
+uint64_t SlabIOBufferAllocator::misses() const
+{
+    uint64_t nmisses = uncached_allocs_.load(std::memory_order_relaxed);
+    for(ThreadCache* cache = caches_.load(std::memory_order_acquire); cache; cache = cache->next) {
+        nmisses += cache->misses.load(std::memory_order_relaxed);
+    }
+    return nmisses;
+}
+
+int64_t SlabIOBufferAllocator::outstanding() const
+{
+    int64_t noutstanding = uncached_allocs_.load(std::memory_order_relaxed) -
+        uncached_frees_.load(std::memory_order_relaxed);
+    for(ThreadCache* cache = caches_.load(std::memory_order_acquire); cache; cache = cache->next) {
+        noutstanding += cache->hits.load(std::memory_order_relaxed) +
+            cache->misses.load(std::memory_order_relaxed) -
+            cache->frees.load(std::memory_order_relaxed);
+    }
+    return noutstanding;
+}
+
+} // namespace paxoslease
@@ -0,0 +1,91 @@
+#ifndef PAXOSLEASE_SLAB_IO_BUFFER_ALLOCATOR_H
+#define PAXOSLEASE_SLAB_IO_BUFFER_ALLOCATOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+#include "io_buffer.h"
+
+namespace paxoslease {
+
+/// IOBufferAllocator recycling blocks without going through malloc.
+///
+/// Every thread keeps two magazines (arrays of up to kMagazineSize free
+/// blocks) and serves Allocate() and Deallocate() from them without any
+/// synchronization. When both are empty, or both are full, the thread swaps
+/// a whole magazine with a lock-free global depot, so blocks freed on one
+/// thread, e.g. after a send, are handed to the thread reading the socket
+/// a magazine at a time. Only when the depot has no full magazine is a
+/// block allocated with new.
+///
+///   SetIOBufferAllocator(new SlabIOBufferAllocator());
+///
+/// Note: like any allocator passed to SetIOBufferAllocator() it is best
+/// never destroyed. If it is, the magazines of threads still running are
+/// freed by those threads, when they exit or once they need the room for
+/// the caches of other allocators.
+class SlabIOBufferAllocator : public IOBufferAllocator {
+public:
+    static const int kMagazineSize = 32;
+    static const int kDepotSlots = 64;
+
+    /// Allocators a thread keeps magazines for. A thread using more gets
+    /// plain new and delete[] from the others.
+    static const int kMaxThreadCaches = 4;
+
+    explicit SlabIOBufferAllocator(size_t buffer_size = 4 << 10);
+    virtual ~SlabIOBufferAllocator();
+
+    virtual size_t GetBufferSize() const { return buffer_size_; }
+    virtual char*  Allocate();
+    virtual void   Deallocate(char* buf);
+
+    /// Counters summed over all threads; each is exact once the threads
+    /// are quiet.
+    uint64_t hits() const;      // blocks recycled
+    uint64_t misses() const;    // blocks allocated with new
+    int64_t outstanding() const; // blocks allocated and not yet deallocated
+
+private:
+    friend struct SlabThreadCaches;
+
+    struct Magazine {
+        Magazine() : count(0) {}
+
+        int count;
+        char* blocks[kMagazineSize];
+    };
+
+    struct ThreadCache;
+
+    ThreadCache* Cache();
+    static void ReleaseCache(ThreadCache* cache);
+
+    char* Refill(ThreadCache* cache);
+    void Spill(ThreadCache* cache, char* buf);
+
+    // the depot: magazines are moved in and out with a single atomic
+    // exchange or compare-and-swap on a slot, so there is no ABA.
+    Magazine* Take(std::atomic<Magazine*>* slots);
+    bool Put(std::atomic<Magazine*>* slots, Magazine* magazine);
+
+    static void Free(Magazine* magazine);
+
+    const size_t buffer_size_;
+    const uint64_t id_; // unique for the process, unlike the address
+
+    std::atomic<Magazine*> full_[kDepotSlots];
+    std::atomic<Magazine*> empty_[kDepotSlots];
+
+    std::atomic<ThreadCache*> caches_; // every cache created, never unlinked
+    std::atomic<uint64_t> uncached_allocs_;
+    std::atomic<uint64_t> uncached_frees_;
+
+    SlabIOBufferAllocator(const SlabIOBufferAllocator&);
+    SlabIOBufferAllocator& operator =(const SlabIOBufferAllocator&);
+};
+
+} // namespace paxoslease
+
+#endif //PAXOSLEASE_SLAB_IO_BUFFER_ALLOCATOR_H
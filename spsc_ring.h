@@ -0,0 +1,94 @@
+#ifndef PAXOSLEASE_SPSC_RING_H
+#define PAXOSLEASE_SPSC_RING_H
+
+#include <assert.h>
+#include <stddef.h>
+#include <atomic>
+#include <utility>
+#include <vector>
+
+namespace paxoslease {
+
+/// Bounded lock-free ring for exactly one producer thread and one consumer
+/// thread. The capacity is rounded up to a power of two. Each side caches
+/// the other side's index and only reloads it when the ring looks full or
+/// empty, so in the common case a push or pop touches no shared cache line
+/// but the slot itself.
+template <typename T>
+class SpscRing {
+public:
+    explicit SpscRing(size_t capacity)
+        : head_(0),
+          cached_tail_(0),
+          tail_(0),
+          cached_head_(0)
+    {
+        size_t size = 2;
+        while(size < capacity) {
+            size <<= 1;
+        }
+        mask_ = size - 1;
+        slots_.resize(size);
+    }
+
+    /// Producer side. Returns false, leaving value untouched, if full.
+    bool TryPush(T&& value)
+    {
+        const size_t tail = tail_.load(std::memory_order_relaxed);
+        if(tail - cached_head_ > mask_) {
+            cached_head_ = head_.load(std::memory_order_acquire);
+            if(tail - cached_head_ > mask_) {
+                return false;
+            }
+        }
+        slots_[tail & mask_] = std::move(value);
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    /// Consumer side. Returns false if empty.
+    bool TryPop(T* value)
+    {
+        const size_t head = head_.load(std::memory_order_relaxed);
+        if(head == cached_tail_) {
+            cached_tail_ = tail_.load(std::memory_order_acquire);
+            if(head == cached_tail_) {
+                return false;
+            }
+        }
+        *value = std::move(slots_[head & mask_]);
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    /// Approximate when called while the other side is running.
+    size_t Size() const
+    {
+        return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire);
+    }
+
+    bool IsEmpty() const { return Size() == 0; }
+
+    size_t capacity() const { return mask_ + 1; }
+
+private:
+    static const size_t kCacheLineSize = 64;
+
+    std::vector<T> slots_;
+    size_t mask_;
+
+    char pad0_[kCacheLineSize];
+    std::atomic<size_t> head_;  // written by the consumer
+    size_t cached_tail_;        // consumer's copy of tail_
+    char pad1_[kCacheLineSize];
+    std::atomic<size_t> tail_;  // written by the producer
+    size_t cached_head_;        // producer's copy of head_
+    char pad2_[kCacheLineSize];
+
+    SpscRing(const SpscRing&);
+    SpscRing& operator =(const SpscRing&);
+};
+
+} // namespace paxoslease
+
+#endif //PAXOSLEASE_SPSC_RING_H
@@ -0,0 +1,257 @@
+#ifndef PAXOSLEASE_STATIC_DISPATCHER_H
+#define PAXOSLEASE_STATIC_DISPATCHER_H
+
+#include <stdint.h>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#include "codec.h"
+#include "crc32c.h"
+#include "fixed_layout.h"
+#include "message_registry.h"
+
+namespace paxoslease {
+
+/// true if FixedLayout<T> is specialized, i.e. T can travel in a fixed frame.
+template <typename T>
+class HasFixedLayout
+{
+private:
+    template <typename U>
+    static std::true_type Check(decltype(sizeof(FixedLayout<U>))*);
+    template <typename U>
+    static std::false_type Check(...);
+
+public:
+    static const bool value = decltype(Check<T>(0))::value;
+};
+
+/// Dispatcher for a closed set of messages known at compile time, such as
+/// the lease protocol:
+///
+///   StaticDispatcher<Acceptor, PrepareRequest, PrepareResponse,
+///                    ProposeRequest, ProposeResponse> dispatcher(&acceptor);
+///   dispatcher.Dispatch(frame, length);
+///
+/// Each frame is decoded into a slot preallocated for its type and handed
+/// to Handler::OnMessage(T&), picked by overload resolution. There is no
+/// std::function, virtual call or dynamic_cast between the frame and the
+/// handler, so the compiler can inline the handler into the decode path.
+/// Messages with a FixedLayout are read straight from fixed frames.
+///
+/// The slots act as the variant of the message set: a slot is reused by
+/// the next frame of its type, so handlers must copy out anything they
+/// keep past OnMessage().
+template <typename Handler, typename... Messages>
+class StaticDispatcher
+{
+public:
+    static const int kNumTypes = sizeof...(Messages);
+
+    explicit StaticDispatcher(Handler* handler)
+        : handler_(handler),
+          index_(MessageRegistry::Instance().size(), -1)
+    {
+        Index<0>();
+    }
+
+    /// Decode the frame at the start of buf, which holds length contiguous
+    /// bytes, and dispatch it. Returns the size of the frame, 0 if buf holds
+    /// less than a whole frame, or -1 if the frame is corrupt or its type
+    /// is not one of Messages.
+    int Dispatch(const char* buf, int length)
+    {
+        if(length < kHeadLengthSpace)
+        {
+            return 0;
+        }
+        const uint32_t head_word = static_cast<uint32_t>(BufToInt32(buf));
+        int format = head_word >> kFrameFormatShift;
+        int32_t head_length = head_word & kMaxHeadLength;
+        if(head_length > length - kHeadLengthSpace)
+        {
+            return 0;
+        }
+
+        const char* content = buf + kHeadLengthSpace;
+        int content_length = head_length;
+        if(format & kFrameChecksum)
+        {
+            content_length -= kChecksumSpace;
+            if(content_length < 0 || Crc32c(buf, kHeadLengthSpace + content_length) !=
+                    static_cast<uint32_t>(BufToInt32(content + content_length)))
+            {
+                return -1;
+            }
+            format &= kFrameFormatMask;
+        }
+
+        int type_id = MessageRegistry::kInvalidTypeId;
+        int type_length = 0;
+        if(!DecodeType(format, content, content_length, &type_id, &type_length))
+        {
+            return -1;
+        }
+        const int index = type_id < static_cast<int>(index_.size()) ? index_[type_id] : -1;
+        if(!Call<0>(index, format, content + type_length, content_length - type_length))
+        {
+            return -1;
+        }
+        return kHeadLengthSpace + head_length;
+    }
+
+    int Dispatch(const std::string& buf)
+    {
+        return Dispatch(buf.data(), static_cast<int>(buf.size()));
+    }
+
+    /// Dispatch every frame of a datagram. Returns the # of frames, or -1
+    /// at the first bad or truncated frame.
+    int DispatchAll(const char* buf, int length)
+    {
+        int ndispatched = 0;
+        while(length > 0)
+        {
+            const int nbytes = Dispatch(buf, length);
+            if(nbytes <= 0)
+            {
+                return -1;
+            }
+            buf += nbytes;
+            length -= nbytes;
+            ndispatched++;
+        }
+        return ndispatched;
+    }
+
+private:
+    typedef std::tuple<Messages...> Slots;
+
+    template <int I>
+    typename std::enable_if<(I < kNumTypes)>::type Index()
+    {
+        typedef typename std::tuple_element<I, Slots>::type T;
+        const int type_id = MessageRegistry::Instance().TypeId(T::descriptor());
+        if(type_id != MessageRegistry::kInvalidTypeId)
+        {
+            index_[type_id] = I;
+        }
+        Index<I + 1>();
+    }
+
+    template <int I>
+    typename std::enable_if<(I == kNumTypes)>::type Index()
+    {
+    }
+
+    // parse the type of a frame, leaving type_length at the payload.
+    static bool DecodeType(int format, const char* content, int content_length,
+            int* type_id, int* type_length)
+    {
+        if(format == kFrameFixed)
+        {
+            if(content_length < kFixedTypeIdSpace)
+            {
+                return false;
+            }
+            *type_id = static_cast<uint8_t>(content[0]);
+            *type_length = kFixedTypeIdSpace;
+            return true;
+        }
+        if(format == kFrameTypeId)
+        {
+            google::protobuf::io::CodedInputStream input(
+                    reinterpret_cast<const uint8_t*>(content), content_length);
+            uint32_t id = 0;
+            if(!input.ReadVarint32(&id) || id > static_cast<uint32_t>(kMaxHeadLength))
+            {
+                return false;
+            }
+            *type_id = id;
+            *type_length = input.CurrentPosition();
+            return true;
+        }
+        if(format == kFrameTypeName)
+        {
+            if(content_length < kTypeNameLengthSpace)
+            {
+                return false;
+            }
+            const int32_t type_name_length = BufToInt32(content);
+            if(type_name_length <= 0 || type_name_length > content_length - kTypeNameLengthSpace)
+            {
+                return false;
+            }
+            // drop the trailing '\0'
+            const google::protobuf::Message* prototype = Name2Prototype(
+                    std::string(content + kTypeNameLengthSpace, type_name_length - 1));
+            if(!prototype)
+            {
+                return false;
+            }
+            *type_id = MessageRegistry::Instance().TypeId(*prototype);
+            *type_length = kTypeNameLengthSpace + type_name_length;
+            return true;
+        }
+        return false;
+    }
+
+    // a chain of compares on a compile-time index: the switch over the set.
+    template <int I>
+    typename std::enable_if<(I < kNumTypes), bool>::type Call(int index, int format,
+            const char* payload, int payload_length)
+    {
+        if(index != I)
+        {
+            return Call<I + 1>(index, format, payload, payload_length);
+        }
+        typedef typename std::tuple_element<I, Slots>::type T;
+        T& message = std::get<I>(slots_);
+        const bool parsed = format == kFrameFixed ?
+            ParseFixed(payload, payload_length, &message,
+                    std::integral_constant<bool, HasFixedLayout<T>::value>()) :
+            message.ParseFromArray(payload, payload_length);
+        if(!parsed)
+        {
+            return false;
+        }
+        handler_->OnMessage(message);
+        return true;
+    }
+
+    template <int I>
+    typename std::enable_if<(I == kNumTypes), bool>::type Call(int, int, const char*, int)
+    {
+        return false;
+    }
+
+    template <typename T>
+    static bool ParseFixed(const char* payload, int payload_length, T* message, std::true_type)
+    {
+        if(payload_length != FixedLayout<T>::kSize)
+        {
+            return false;
+        }
+        FixedLayout<T>::Read(payload, message);
+        return true;
+    }
+
+    template <typename T>
+    static bool ParseFixed(const char*, int, T*, std::false_type)
+    {
+        return false;
+    }
+
+    Handler* handler_;
+    Slots slots_;
+    std::vector<int> index_; // tuple index by type id, -1 if not in the set
+
+    StaticDispatcher(const StaticDispatcher&);
+    StaticDispatcher& operator =(const StaticDispatcher&);
+};
+
+} // namespace paxoslease
+
+#endif //PAXOSLEASE_STATIC_DISPATCHER_H
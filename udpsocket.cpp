@@ -1,4 +1,5 @@
 #include "udpsocket.h"
+#include "io_buffer.h"
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -71,11 +72,26 @@ int UdpSocket::Broadcast(const char* buf, int size)
     return Send(buf, size, &broadcast_addr_, sizeof(broadcast_addr_));
 }
 
+int UdpSocket::Send(IOBuffer* buf, const sockaddr_in* send_addr, const int addr_len)
+{
+    return buf->SendTo(udp_fd_, (struct sockaddr*)send_addr, addr_len);
+}
+
+int UdpSocket::Broadcast(IOBuffer* buf)
+{
+    return Send(buf, &broadcast_addr_, sizeof(broadcast_addr_));
+}
+
 int UdpSocket::Recv(char* buf, int size, sockaddr_in* recv_addr, int* addr_len)
 {
     return recvfrom(udp_fd_, buf, size, 0, (struct sockaddr*)recv_addr, (socklen_t*)addr_len);
 }
 
+int UdpSocket::Recv(IOBuffer* buf, int max_size, sockaddr_in* recv_addr, int* addr_len)
+{
+    return buf->RecvFrom(udp_fd_, max_size, (struct sockaddr*)recv_addr, addr_len);
+}
+
 void UdpSocket::Close()
 {
     if(udp_fd_ > 0) {
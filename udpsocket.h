@@ -6,6 +6,8 @@
 namespace paxoslease
 {
 
+class IOBuffer;
+
 class UdpSocket
 {
 public:
@@ -16,7 +18,10 @@ int Open();
 
 int Send(const char* buf, int size, const sockaddr_in* send_addr, const int addr_len);
 int Broadcast(const char* buf, int size);
+int Send(IOBuffer* buf, const sockaddr_in* send_addr, const int addr_len);
+int Broadcast(IOBuffer* buf);
 int Recv(char* buf, int size, sockaddr_in* recv_addr, int* addr_len);
+int Recv(IOBuffer* buf, int max_size, sockaddr_in* recv_addr, int* addr_len);
 
 void Close();
 
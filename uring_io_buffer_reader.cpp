@@ -0,0 +1,349 @@
+#include "uring_io_buffer_reader.h"
+
+#include <algorithm>
+#include <limits>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+namespace paxoslease {
+
+// no liburing: the three system calls are all we need.
+static int IOUringSetup(unsigned entries, struct io_uring_params* params)
+{
+    return static_cast<int>(::syscall(__NR_io_uring_setup, entries, params));
+}
+
+static int IOUringEnter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return static_cast<int>(::syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+                flags, NULL, 0));
+}
+
+static int IOUringRegister(int ring_fd, unsigned opcode, void* arg, unsigned nr_args)
+{
+    return static_cast<int>(::syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args));
+}
+
+static void* MapRing(size_t size, int ring_fd, off_t offset)
+{
+    void* const ring = ::mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring_fd, offset);
+    return ring == MAP_FAILED ? NULL : ring;
+}
+
+template <typename T>
+static T* RingField(void* ring, uint32_t offset)
+{
+    return reinterpret_cast<T*>(static_cast<char*>(ring) + offset);
+}
+
+UringIOBufferReader::UringIOBufferReader(int num_blocks, size_t buffer_size)
+    : buffer_size_(buffer_size),
+      num_blocks_(1),
+      region_(0),
+      ring_fd_(-1),
+      sq_ring_(0),
+      sq_ring_size_(0),
+      cq_ring_(0),
+      cq_ring_size_(0),
+      sqes_(0),
+      sqes_size_(0),
+      sq_tail_(0),
+      sq_mask_(0),
+      sq_array_(0),
+      cq_head_(0),
+      cq_tail_(0),
+      cq_mask_(0),
+      cqes_(0),
+      buf_ring_(0),
+      buf_ring_size_(0),
+      buf_ring_tail_(0),
+      free_head_(kNil),
+      next_(),
+      fallbacks_(0)
+{
+    while(num_blocks_ < uint32_t(std::max(num_blocks, 1)) && num_blocks_ < (1 << 15)) {
+        num_blocks_ <<= 1;
+    }
+    if(buffer_size_ <= size_t(IOBufferData::block_header_size()) ||
+            buffer_size_ > size_t(std::numeric_limits<int>::max())) {
+        return;
+    }
+    if(! Setup()) {
+        Shutdown();
+    }
+}
+
+UringIOBufferReader::~UringIOBufferReader()
+{
+    Shutdown();
+    if(region_) {
+        ::munmap(region_, num_blocks_ * buffer_size_);
+    }
+}
+
+bool UringIOBufferReader::Setup()
+{
+    // one batch of reads is in flight at a time.
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring_fd_ = IOUringSetup(kMaxBatch, &params);
+    if(ring_fd_ < 0) {
+        ring_fd_ = -1;
+        return false;
+    }
+
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    }
+    sq_ring_ = MapRing(sq_ring_size_, ring_fd_, IORING_OFF_SQ_RING);
+    if(! sq_ring_) {
+        return false;
+    }
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        cq_ring_ = sq_ring_;
+    } else if(! (cq_ring_ = MapRing(cq_ring_size_, ring_fd_, IORING_OFF_CQ_RING))) {
+        return false;
+    }
+    sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes_ = static_cast<struct io_uring_sqe*>(MapRing(sqes_size_, ring_fd_, IORING_OFF_SQES));
+    if(! sqes_) {
+        return false;
+    }
+
+    sq_tail_ = RingField<unsigned>(sq_ring_, params.sq_off.tail);
+    sq_mask_ = RingField<unsigned>(sq_ring_, params.sq_off.ring_mask);
+    sq_array_ = RingField<unsigned>(sq_ring_, params.sq_off.array);
+    cq_head_ = RingField<unsigned>(cq_ring_, params.cq_off.head);
+    cq_tail_ = RingField<unsigned>(cq_ring_, params.cq_off.tail);
+    cq_mask_ = RingField<unsigned>(cq_ring_, params.cq_off.ring_mask);
+    cqes_ = RingField<struct io_uring_cqe>(cq_ring_, params.cq_off.cqes);
+
+    void* region = ::mmap(NULL, num_blocks_ * buffer_size_, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(region == MAP_FAILED) {
+        return false;
+    }
+    region_ = static_cast<char*>(region);
+    next_.reset(new std::atomic<uint32_t>[num_blocks_]);
+
+    // the provided-buffer ring must be page aligned: mmap it too.
+    buf_ring_size_ = num_blocks_ * sizeof(struct io_uring_buf);
+    void* buf_ring = ::mmap(NULL, buf_ring_size_, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(buf_ring == MAP_FAILED) {
+        return false;
+    }
+    buf_ring_ = static_cast<struct io_uring_buf*>(buf_ring);
+
+    // fill the ring before registering it: the kernel pins the page, and a
+    // page never written to would be the shared zero page, not ours.
+    for(uint32_t i = 0; i < num_blocks_; i++) {
+        Provide(i);
+    }
+    __atomic_store_n(&buf_ring_[0].resv, buf_ring_tail_, __ATOMIC_RELEASE);
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = reinterpret_cast<uintptr_t>(buf_ring_);
+    reg.ring_entries = num_blocks_;
+    reg.bgid = kBufferGroup;
+    if(IOUringRegister(ring_fd_, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        ::munmap(buf_ring_, buf_ring_size_);
+        buf_ring_ = 0;
+        return false;
+    }
+    return true;
+}
+
+// close the ring and drop its mappings. The region stays: IOBuffers may
+// still hold blocks of it.
+void UringIOBufferReader::Shutdown()
+{
+    if(ring_fd_ >= 0) {
+        ::close(ring_fd_);
+        ring_fd_ = -1;
+    }
+    if(buf_ring_) {
+        ::munmap(buf_ring_, buf_ring_size_);
+        buf_ring_ = 0;
+    }
+    if(sqes_) {
+        ::munmap(sqes_, sqes_size_);
+        sqes_ = 0;
+    }
+    if(cq_ring_ && cq_ring_ != sq_ring_) {
+        ::munmap(cq_ring_, cq_ring_size_);
+    }
+    cq_ring_ = 0;
+    if(sq_ring_) {
+        ::munmap(sq_ring_, sq_ring_size_);
+        sq_ring_ = 0;
+    }
+}
+
+// queue a block in the provided-buffer ring; the tail is published by
+// the caller. The kernel fills the block after the room for its header.
+// The fields are set one by one: the tail of the ring is the resv field of
+// the first entry.
+void UringIOBufferReader::Provide(uint32_t index)
+{
+    const int header_size = IOBufferData::block_header_size();
+    struct io_uring_buf* const entry = &buf_ring_[buf_ring_tail_ & (num_blocks_ - 1)];
+    entry->addr = reinterpret_cast<uintptr_t>(region_ + index * buffer_size_ + header_size);
+    entry->len = static_cast<uint32_t>(buffer_size_ - header_size);
+    entry->bid = static_cast<uint16_t>(index);
+    buf_ring_tail_++;
+}
+
+// put every block given back since the last call back in the ring.
+void UringIOBufferReader::Recycle()
+{
+    uint32_t index = free_head_.exchange(kNil, std::memory_order_acquire);
+    if(index == kNil) {
+        return;
+    }
+    while(index != kNil) {
+        Provide(index);
+        index = next_[index].load(std::memory_order_relaxed);
+    }
+    __atomic_store_n(&buf_ring_[0].resv, buf_ring_tail_, __ATOMIC_RELEASE);
+}
+
+void UringIOBufferReader::Deallocate(char* buf)
+{
+    if(! Contains(buf)) {
+        delete [] buf;
+        return;
+    }
+    const uint32_t index = static_cast<uint32_t>((buf - region_) / buffer_size_);
+    uint32_t head = free_head_.load(std::memory_order_relaxed);
+    do {
+        next_[index].store(head, std::memory_order_relaxed);
+    } while(! free_head_.compare_exchange_weak(head, index, std::memory_order_release));
+}
+
+int UringIOBufferReader::ReadBatch(int fd, const int* lens, int n, int* results, uint32_t* indices)
+{
+    const unsigned tail = *sq_tail_;
+    for(int i = 0; i < n; i++) {
+        const unsigned slot = (tail + i) & *sq_mask_;
+        struct io_uring_sqe* const sqe = &sqes_[slot];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READ;
+        // linked, the reads run one after the other, in order.
+        sqe->flags = IOSQE_BUFFER_SELECT | (i + 1 < n ? IOSQE_IO_LINK : 0);
+        sqe->fd = fd;
+        sqe->off = uint64_t(-1); // current position, and the only one of a socket or pipe
+        sqe->len = lens[i];
+        sqe->rw_flags = RWF_NOWAIT; // -EAGAIN rather than io_uring polling the fd
+        sqe->buf_group = kBufferGroup;
+        sqe->user_data = i;
+        sq_array_[slot] = slot;
+    }
+    __atomic_store_n(sq_tail_, tail + n, __ATOMIC_RELEASE);
+
+    unsigned to_submit = n;
+    const unsigned head = *cq_head_;
+    unsigned ncompleted;
+    while((ncompleted = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE) - head) < unsigned(n)) {
+        const int ret = IOUringEnter(ring_fd_, to_submit, n - ncompleted, IORING_ENTER_GETEVENTS);
+        if(ret < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return (errno > 0 ? -errno : -EIO);
+        }
+        to_submit -= std::min<unsigned>(to_submit, ret);
+    }
+
+    for(int i = 0; i < n; i++) {
+        const struct io_uring_cqe* const cqe = &cqes_[(head + i) & *cq_mask_];
+        const int k = static_cast<int>(cqe->user_data);
+        results[k] = cqe->res;
+        indices[k] = (cqe->flags & IORING_CQE_F_BUFFER) ? cqe->flags >> IORING_CQE_BUFFER_SHIFT : kNil;
+    }
+    __atomic_store_n(cq_head_, head + n, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int UringIOBufferReader::Read(int fd, IOBuffer* buf, int max_read_ahead)
+{
+    if(ring_fd_ < 0) {
+        return buf->Read(fd, max_read_ahead);
+    }
+    Recycle();
+
+    const int data_size = int(buffer_size_) - IOBufferData::block_header_size();
+    int max_read = (max_read_ahead >= 0 ? max_read_ahead : std::numeric_limits<int>::max());
+    int total_read = 0;
+
+    int lens[kMaxBatch];
+    int results[kMaxBatch];
+    uint32_t indices[kMaxBatch];
+
+    bool fallback = false;
+    while(max_read > 0) {
+        int n = 0;
+        for(int left = max_read; left > 0 && n < kMaxBatch; n++) {
+            lens[n] = std::min(left, data_size);
+            left -= lens[n];
+        }
+        if(ReadBatch(fd, lens, n, results, indices) < 0) {
+            // SQEs may be left behind: this ring can not be trusted anymore.
+            Shutdown();
+            fallback = true;
+            break;
+        }
+
+        // a read after a short or failed one may still have found data,
+        // arrived in between: whatever was read goes in, in order.
+        bool full = true;
+        for(int i = 0; i < n; i++) {
+            const int nread = results[i];
+            if(indices[i] != kNil) {
+                if(nread > 0) {
+                    // the header goes in the room left for it: no allocation.
+                    buf->Append(IOBufferData(*this, region_ + indices[i] * buffer_size_, nread));
+                } else {
+                    Deallocate(region_ + indices[i] * buffer_size_);
+                }
+            }
+            if(nread > 0) {
+                total_read += nread;
+                max_read -= nread;
+            } else if(nread == -ENOBUFS || nread == -EOPNOTSUPP) {
+                // -EOPNOTSUPP: a kernel or file that can not read with RWF_NOWAIT.
+                if(! fallback) {
+                    fallbacks_++;
+                }
+                fallback = true;
+            } else if(total_read == 0 && nread != -ECANCELED) {
+                total_read = nread; // 0 at end of file or -errno
+            }
+            full = full && nread == lens[i];
+        }
+        if(! full || fallback) {
+            break; // short read: nothing more for now.
+        }
+    }
+
+    if(fallback && max_read > 0) {
+        const int n = buf->Read(fd, max_read);
+        if(n > 0) {
+            total_read = std::max(total_read, 0) + n;
+        } else if(total_read == 0) {
+            total_read = n;
+        }
+    }
+    return total_read;
+}
+
+} // namespace paxoslease
@@ -0,0 +1,135 @@
+#ifndef PAXOSLEASE_URING_IO_BUFFER_READER_H
+#define PAXOSLEASE_URING_IO_BUFFER_READER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+
+#include "io_buffer.h"
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct io_uring_buf;
+
+namespace paxoslease {
+
+/// Reads into IOBuffers through io_uring with a provided-buffer ring: the
+/// kernel picks a free block of a registered region for each read, and the
+/// filled block is appended to the IOBuffer as is, its header written in
+/// the room kept for it at the front. Nothing is allocated ahead of a read
+/// or for it, and nothing is freed after a short one, unlike
+/// IOBuffer::Read(), which prepares up to 17 blocks per readv(2).
+///
+///   UringIOBufferReader reader;
+///   int nread = reader.Read(fd, &buf);
+///
+/// The reader is the IOBufferAllocator of the blocks it hands out; when the
+/// last IOBufferData of one goes, from any thread, the block is queued and
+/// goes back to the ring on the next Read().
+///
+/// Without io_uring (old kernel, seccomp, no provided-buffer rings), when
+/// every block is still held by some IOBuffer, or after the ring failed,
+/// Read() falls back to IOBuffer::Read().
+///
+/// Reads never wait for data, whether or not the fd is O_NONBLOCK: with
+/// nothing there Read() returns -EAGAIN, as IOBuffer::Read() does on the
+/// non-blocking fds of the network layer.
+///
+/// Reads of up to 16 blocks go in with one io_uring_enter(2), yet each
+/// block is still a request of its own to the kernel: 64KB from a pipe or
+/// socketpair takes about twice as long as with IOBuffer::Read(), which
+/// stays the default read path. The reader pays when the allocations per
+/// read matter more than the time.
+///
+/// Note: one thread at a time may call Read(), and the reader must outlive
+/// every block it handed out.
+class UringIOBufferReader : public IOBufferAllocator {
+public:
+    /// num_blocks is rounded up to a power of two, at most 32768. Each
+    /// block holds buffer_size bytes, header included, like the blocks of
+    /// any IOBufferAllocator.
+    explicit UringIOBufferReader(int num_blocks = 256, size_t buffer_size = 4 << 10);
+    virtual ~UringIOBufferReader();
+
+    /// Read like IOBuffer::Read(): up to max_read_ahead bytes, all there are
+    /// when negative, appended to buf. Returns the # of bytes read, 0 at end
+    /// of file, or -errno when nothing was read.
+    int Read(int fd, IOBuffer* buf, int max_read_ahead = -1);
+
+    /// false when Read() always takes the readv path.
+    bool available() const { return ring_fd_ >= 0; }
+
+    virtual size_t GetBufferSize() const { return buffer_size_; }
+    /// Blocks come from the kernel; this is only for the odd caller that
+    /// allocates from the reader, and gives out plain new blocks.
+    virtual char*  Allocate() { return new char[buffer_size_]; }
+    virtual void   Deallocate(char* buf);
+
+    /// Reads that took the readv path because the ring was empty or the
+    /// fd can not be read without waiting through io_uring.
+    uint64_t fallbacks() const { return fallbacks_; }
+
+private:
+    static const uint32_t kNil = 0xffffffff;
+    static const uint16_t kBufferGroup = 0;
+    static const int kMaxBatch = 16;    // reads per io_uring_enter(2)
+
+    bool Setup();
+    void Shutdown();
+
+    void Provide(uint32_t index);
+    void Recycle();
+
+    /// Submit n linked reads of fd, of at most lens[i] bytes each, with one
+    /// io_uring_enter(2), and wait for them all. Returns 0 with their
+    /// results and blocks (kNil for none) by read, or -errno of
+    /// io_uring_enter(2).
+    int ReadBatch(int fd, const int* lens, int n, int* results, uint32_t* indices);
+
+    bool Contains(const char* buf) const
+    {
+        return buf >= region_ && buf < region_ + num_blocks_ * buffer_size_;
+    }
+
+    const size_t buffer_size_;
+    uint32_t num_blocks_;
+    char* region_;
+
+    int ring_fd_;
+    void* sq_ring_;
+    size_t sq_ring_size_;
+    void* cq_ring_;
+    size_t cq_ring_size_;
+    io_uring_sqe* sqes_;
+    size_t sqes_size_;
+
+    unsigned* sq_tail_;
+    unsigned* sq_mask_;
+    unsigned* sq_array_;
+    unsigned* cq_head_;
+    unsigned* cq_tail_;
+    unsigned* cq_mask_;
+    io_uring_cqe* cqes_;
+
+    // the entries of the provided-buffer ring. Not io_uring_buf_ring:
+    // its flexible array member is laid out differently by C++ compilers.
+    io_uring_buf* buf_ring_;
+    size_t buf_ring_size_;
+    uint16_t buf_ring_tail_;
+
+    // blocks given back and not yet in the ring: a stack of block indices.
+    // Only Recycle() pops, and it takes the whole stack at once, so pushes
+    // need no ABA tag.
+    std::atomic<uint32_t> free_head_;
+    std::unique_ptr<std::atomic<uint32_t>[]> next_; // by block index
+
+    uint64_t fallbacks_;
+
+    UringIOBufferReader(const UringIOBufferReader&);
+    UringIOBufferReader& operator =(const UringIOBufferReader&);
+};
+
+} // namespace paxoslease
+
+#endif //PAXOSLEASE_URING_IO_BUFFER_READER_H